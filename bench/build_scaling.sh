@@ -0,0 +1,32 @@
+#!/bin/sh
+# Time of an ahead-of-time build against the number of compiler processes,
+# on a generated program of FUNCTIONS functions (default 4000).
+#
+#   bench/build_scaling.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+# Each function calls the one before it, so main reaches all of them.
+awk -v n="${FUNCTIONS:-4000}" '
+function name(i, s) {
+  s = ""
+  do {
+    s = substr("abcdefghijklmnopqrstuvwxyz", i % 26 + 1, 1) s
+    i = int(i / 26)
+  } while (i > 0)
+  return "f_" s
+}
+BEGIN {
+  for (i = 0; i < n; i++) {
+    printf "%s(x, y) if lt(x, y) then add(mul(x, %d), sub(y, div(x, 3))) ", name(i), i + 1
+    printf "else %s(sub(x, y), add(y, %d))\n", i ? name(i - 1) : "f_a", i + 1
+  }
+  printf "main() print(%s(1, 2))\n", name(n - 1)
+}' > program.yo
+
+printf '%-6s %10s %8s\n' jobs ms speedup
+base=
+for jobs in $(threads); do
+  ms=$(millis "$yonto" build -j "$jobs" -o program program.yo)
+  base=${base:-$ms}
+  printf '%-6s %10s %8s\n' "$jobs" "$ms" "$(ratio "$base" "$ms")"
+done
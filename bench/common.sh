@@ -0,0 +1,39 @@
+# Sourced by every benchmark with the path of yonto as $1. Leaves yonto as an
+# absolute path and the shell in a scratch directory removed on exit.
+set -eu
+yonto=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# Wall time of a command in milliseconds, the best of three runs. Its output
+# is discarded.
+millis() {
+  best=
+  for _ in 1 2 3; do
+    start=$(date +%s%N)
+    "$@" > /dev/null
+    end=$(date +%s%N)
+    took=$(((end - start) / 1000000))
+    if [ -z "$best" ] || [ "$took" -lt "$best" ]; then
+      best=$took
+    fi
+  done
+  echo "$best"
+}
+
+# 1, 2, 4 and so on up to the number of cores, which is always included.
+threads() {
+  cores=$(nproc)
+  n=1
+  while [ "$n" -lt "$cores" ]; do
+    echo "$n"
+    n=$((n * 2))
+  done
+  echo "$cores"
+}
+
+# Prints a / b with two decimals.
+ratio() {
+  awk -v a="$1" -v b="$2" 'BEGIN { printf "%.2f\n", (b > 0 ? a / b : 0) }'
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Background jobs of 50ms each, all started and then awaited with wait, by the
+# shell DSL and by /bin/sh. The shell DSL reaps them in batches on its event
+# loop, with at most 256 running at once.
+#
+#   bench/event_loop.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+printf '%-8s %8s %10s %10s\n' runner jobs ms jobs/s
+for n in 100 1000 4000; do
+  cat > jobs.yo <<Y
+start(i, last) if eq(i, 0) then last else start(sub(i, 1), \`sleep 0.05 &\`)
+waitall(i) if eq(i, 0) then 0 else add(wait(i), waitall(sub(i, 1)))
+main() print(waitall(start($n, 0)))
+Y
+  cat > jobs.sh <<Y
+i=0
+while [ \$i -lt $n ]; do sleep 0.05 & i=\$((i + 1)); done
+wait
+Y
+  ms=$(millis "$yonto" run jobs.yo)
+  printf '%-8s %8s %10s %10s\n' yonto "$n" "$ms" "$(ratio "$((n * 1000))" "$ms")"
+  ms=$(millis /bin/sh jobs.sh)
+  printf '%-8s %8s %10s %10s\n' /bin/sh "$n" "$ms" "$(ratio "$((n * 1000))" "$ms")"
+done
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Cost of calling the C function labs from a loop of CALLS iterations (default
+# 10^8, a hundredth in the interpreter), against the same loop calling a
+# script function, natively and in the interpreter.
+#
+#   bench/ffi.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+n=${CALLS:-100000000}
+script() {
+  cat <<Y
+extern labs(x)
+mine(x) if lt(x, 0) then sub(0, x) else x
+loop(i, acc) if eq(i, 0) then acc else loop(sub(i, 1), add(acc, $1(sub(0, i))))
+main() print(loop($2, 0))
+Y
+}
+
+printf '%-12s %-8s %12s %10s %10s\n' mode callee calls ms ns/call
+for callee in labs mine; do
+  script "$callee" "$n" > native.yo
+  script "$callee" "$((n / 100))" > interpreted.yo
+  ms=$(millis "$yonto" run native.yo)
+  printf '%-12s %-8s %12s %10s %10s\n' native "$callee" "$n" "$ms" \
+    "$(ratio "$((ms * 1000000))" "$n")"
+  ms=$(millis "$yonto" run --no-jit interpreted.yo)
+  printf '%-12s %-8s %12s %10s %10s\n' interpreter "$callee" "$((n / 100))" \
+    "$ms" "$(ratio "$((ms * 1000000))" "$((n / 100))")"
+done
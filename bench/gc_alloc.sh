@@ -0,0 +1,33 @@
+#!/bin/sh
+# Allocation rate and collector pauses by nursery size, from --gc-stats, for
+# short-lived closures and for a list that survives while garbage is made.
+#
+#   bench/gc_alloc.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+cat > short.yo <<'Y'
+compose(f, g) (x) => f(g(x))
+adder(n) (x) => add(x, n)
+loop(i, acc) if eq(i, 0) then acc else loop(sub(i, 1), add(acc, (compose(adder(i), adder(1)))(i)))
+main() print(loop(3000000, 0))
+Y
+cat > retained.yo <<'Y'
+pair(a, b) (k) => k(a, b)
+adder(n) (x) => add(x, n)
+build(n, acc) if eq(n, 0) then acc else build(sub(n, 1), pair((adder(n))(1), acc))
+first(l) l((a, b) => a)
+main() print(first(build(1000000, pair(0, 1))))
+Y
+
+printf '%-10s %8s %10s %7s %7s %9s %9s\n' workload nursery MiB/s minor major \
+  avg-ms max-ms
+for workload in short retained; do
+  for kib in 256 1024 4096 16384; do
+    "$yonto" run --gc-stats --gc-nursery="$kib" "$workload.yo" \
+      2> stats > /dev/null
+    rate=$(sed -n 's/^gc: allocated .*(\([0-9.]*\)MiB\/s).*/\1/p' stats)
+    set -- $(sed -n 's/^gc: \([0-9]*\) minor, \([0-9]*\) major, [0-9]* pauses (\([0-9.]*\)ms avg, \([0-9.]*\)ms max)/\1 \2 \3 \4/p' stats)
+    printf '%-10s %8s %10s %7s %7s %9s %9s\n' "$workload" "$kib" "$rate" \
+      "$1" "$2" "$3" "$4"
+  done
+done
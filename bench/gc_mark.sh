@@ -0,0 +1,32 @@
+#!/bin/sh
+# Mark throughput against --gc-threads, from --gc-stats, for a wide graph (a
+# balanced tree) and a deep one (a long list) kept alive while garbage is made
+# around them.
+#
+#   bench/gc_mark.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+common='pair(a, b) (k) => k(a, b)
+adder(n) (x) => add(x, n)
+churn(i, acc) if eq(i, 0) then acc else churn(sub(i, 1), add(acc, (adder(i))(1)))
+keep(t, n) add(churn(n, 0), t((a, b) => 0))'
+cat > wide.yo <<Y
+$common
+tree(d) if eq(d, 0) then pair(1, 1) else pair(tree(sub(d, 1)), tree(sub(d, 1)))
+main() print(keep(tree(19), 5000000))
+Y
+cat > deep.yo <<Y
+$common
+build(n, acc) if eq(n, 0) then acc else build(sub(n, 1), pair(n, acc))
+main() print(keep(build(1000000, pair(0, 1)), 5000000))
+Y
+
+printf '%-6s %8s %12s %10s %10s\n' graph threads objects ms Mobjects/s
+for graph in wide deep; do
+  for n in $(threads); do
+    "$yonto" run --gc-stats --gc-threads="$n" "$graph.yo" 2> stats > /dev/null
+    set -- $(sed -n 's/^gc: marked \([0-9]*\) objects in \([0-9.]*\)ms.*/\1 \2/p' stats)
+    printf '%-6s %8s %12s %10s %10s\n' "$graph" "$n" "$1" "$2" \
+      "$(ratio "$1" "$(awk -v ms="$2" 'BEGIN { print ms * 1000 }')")"
+  done
+done
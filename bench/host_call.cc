@@ -0,0 +1,60 @@
+#include "libyonto.h"
+
+#include <chrono>
+#include <cstdio>
+
+// Latency of calling a script function from the host, through the native code
+// of the script and through an isolate.
+//
+//   host_call <script.yo>
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <script.yo>\n", argv[0]);
+    return 1;
+  }
+  std::string error{};
+  auto script = jian::Script::Compile(argv[1], error);
+  if (!script) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+  auto isolate = jian::Isolate::Create(*script);
+
+  auto report = [](const char *path, int64_t calls, auto start, int64_t sum) {
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    printf("%-10s %12lld %10.1f %10.2f (%lld)\n", path,
+           static_cast<long long>(calls), elapsed.count() / 1e6,
+           elapsed.count() / static_cast<double>(calls),
+           static_cast<long long>(sum));
+  };
+  printf("%-10s %12s %10s %10s\n", "path", "calls", "ms", "ns/call");
+
+  if (auto score = script->Function<int64_t, int64_t>("score")) {
+    constexpr int64_t calls = 100000000;
+    int64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int64_t i = 0; i < calls; i++) {
+      sum += score(i, 1000);
+    }
+    report("function", calls, start, sum);
+  } else {
+    printf("%-10s %12s\n", "function", "no native code");
+  }
+
+  constexpr int64_t calls = 10000000;
+  std::vector<int64_t> args{0, 1000};
+  int64_t sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int64_t i = 0; i < calls; i++) {
+    int64_t result = 0;
+    args[0] = i;
+    if (!isolate->Call("score", args, result, error)) {
+      fprintf(stderr, "%s\n", error.c_str());
+      return 1;
+    }
+    sum += result;
+  }
+  report("isolate", calls, start, sum);
+  return 0;
+}
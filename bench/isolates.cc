@@ -0,0 +1,67 @@
+#include "libyonto.h"
+
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+
+// Time to create isolates of one script and the memory each one takes, as
+// mapped by its heap and as resident in the process.
+//
+//   isolates <script.yo>
+
+static size_t resident() {
+  long pages = 0;
+  if (auto f = fopen("/proc/self/statm", "r")) {
+    if (fscanf(f, "%*s %ld", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(f);
+  }
+  return static_cast<size_t>(pages) * static_cast<size_t>(getpagesize());
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <script.yo>\n", argv[0]);
+    return 1;
+  }
+  std::string error{};
+  auto script = jian::Script::Compile(argv[1], error);
+  if (!script) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  printf("%-10s %12s %12s %12s\n", "isolates", "us/create", "heap KiB",
+         "rss KiB");
+  for (size_t n : {10, 100, 1000}) {
+    std::vector<std::unique_ptr<jian::Isolate>> isolates{};
+    isolates.reserve(n);
+    auto before = resident();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i++) {
+      isolates.push_back(jian::Isolate::Create(*script));
+    }
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+    // A call each, so that every heap has been used once.
+    for (auto &isolate : isolates) {
+      int64_t result = 0;
+      if (!isolate->Call("score", {1, 2}, result, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+      }
+    }
+    size_t heap = 0;
+    for (const auto &isolate : isolates) {
+      heap += isolate->Footprint();
+    }
+    auto after = resident();
+    auto rss = after > before ? after - before : 0;
+    printf("%-10zu %12.1f %12.1f %12.1f\n", n,
+           elapsed.count() / static_cast<double>(n),
+           static_cast<double>(heap) / 1024 / static_cast<double>(n),
+           static_cast<double>(rss) / 1024 / static_cast<double>(n));
+  }
+  return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Commands launched per second by the shell DSL and by /bin/sh, one at a time
+# and all in the background before waiting, for LAUNCHES commands (default
+# 5000). /bin/sh runs /bin/true, since its own true is a builtin.
+#
+#   bench/launch.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+n=${LAUNCHES:-5000}
+cat > foreground.yo <<Y
+loop(i, acc) if eq(i, 0) then acc else loop(sub(i, 1), add(acc, \`true\`))
+main() print(loop($n, 0))
+Y
+cat > background.yo <<Y
+start(i) if eq(i, 0) then 0 else add(mul(\`true &\`, 0), start(sub(i, 1)))
+main() print(start($n))
+Y
+cat > foreground.sh <<Y
+i=0
+while [ \$i -lt $n ]; do /bin/true; i=\$((i + 1)); done
+Y
+cat > background.sh <<Y
+i=0
+while [ \$i -lt $n ]; do /bin/true & i=\$((i + 1)); done
+wait
+Y
+
+row() {
+  ms=$(millis "$@")
+  printf '%-12s %-10s %10s %12s\n' "$runner" "$mode" "$ms" \
+    "$(ratio "$((n * 1000))" "$ms")"
+}
+printf '%-12s %-10s %10s %12s\n' runner mode ms launches/s
+runner=yonto mode=foreground row "$yonto" run foreground.yo
+runner=yonto mode=background row "$yonto" run background.yo
+runner=/bin/sh mode=foreground row /bin/sh foreground.sh
+runner=/bin/sh mode=background row /bin/sh background.sh
@@ -0,0 +1,31 @@
+#!/bin/sh
+# par_map followed by par_reduce against the element count and
+# --task-threads. Each size repeats the pair over TOTAL elements in all
+# (default 5*10^7), and the time to fill the array is measured apart and taken
+# off.
+#
+#   bench/map_reduce.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+script() {
+  cat <<Y
+put(a, i) if set(a, i, i) then a else a
+fill(a, i) if eq(i, len(a)) then a else fill(put(a, i), add(i, 1))
+sq(x) mul(x, x)
+reps(a, r, acc) if eq(r, 0) then acc else reps(a, sub(r, 1), add(acc, par_reduce(add, 0, par_map(sq, a))))
+main() print(reps(fill(array($1), 0), $2, 0))
+Y
+}
+
+total=${TOTAL:-50000000}
+printf '%-10s %8s %10s %12s\n' elements threads ms Melements/s
+for size in 10000 100000 1000000; do
+  script "$size" $((total / size)) > map.yo
+  script "$size" 0 > fill.yo
+  for n in $(threads); do
+    ms=$(($(millis "$yonto" run --task-threads="$n" map.yo) -
+      $(millis "$yonto" run --task-threads="$n" fill.yo)))
+    printf '%-10s %8s %10s %12s\n' "$size" "$n" "$ms" \
+      "$(ratio "$((total / 1000))" "$ms")"
+  done
+done
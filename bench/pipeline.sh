@@ -0,0 +1,24 @@
+#!/bin/sh
+# Throughput of pipelines over a file of SIZE_MB MiB (default 1024), with the
+# builtin commands moving data in this process and with --external-commands.
+#
+#   bench/pipeline.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+bytes=$((${SIZE_MB:-1024} * 1024 * 1024))
+yes 'GET /index.html 200 1234 0.042' | head -c "$bytes" > input
+
+printf '%-34s %-9s %8s %8s\n' pipeline commands ms GB/s
+for pipeline in 'cat input | wc -c' 'cat input | cat | cat | wc -c' \
+  'cat input | tee /dev/null | wc -l' 'cat input | grep -c 404'; do
+  printf 'main() print(`%s`)\n' "$pipeline" > pipeline.yo
+  for commands in builtin external; do
+    flags=
+    if [ "$commands" = external ]; then
+      flags=--external-commands
+    fi
+    ms=$(millis "$yonto" run $flags pipeline.yo)
+    printf '%-34s %-9s %8s %8s\n' "$pipeline" "$commands" "$ms" \
+      "$(ratio "$bytes" "$((ms * 1000000))")"
+  done
+done
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Vector and scalar lowering (--no-simd) of array kernels: a dot product of an
+# array with itself as a reduction, and saxpy as a map with a captured factor.
+# Both run on one thread over TOTAL elements in all (default 10^9), less the
+# time to fill the array.
+#
+#   bench/simd.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+reps=$((${TOTAL:-1000000000} / 1000000))
+common='put(a, i) if set(a, i, rem(i, 1000)) then a else a
+fill(a, i) if eq(i, len(a)) then a else fill(put(a, i), add(i, 1))'
+cat > dot.yo <<Y
+$common
+dot(a) par_reduce((acc, x) => add(acc, mul(x, x)), 0, a)
+reps(a, r, acc) if eq(r, 0) then acc else reps(a, sub(r, 1), add(acc, dot(a)))
+main() print(reps(fill(array(1000000), 0), $reps, 0))
+Y
+cat > saxpy.yo <<Y
+$common
+saxpy(a, k) par_map((x) => add(mul(x, k), 3), a)
+reps(a, r, acc) if eq(r, 0) then acc else reps(a, sub(r, 1), add(acc, len(saxpy(a, r))))
+main() print(reps(fill(array(1000000), 0), $reps, 0))
+Y
+
+cat > fill.yo <<Y
+$common
+main() print(len(fill(array(1000000), 0)))
+Y
+
+fill=$(millis "$yonto" run --task-threads=1 fill.yo)
+printf '%-8s %-8s %10s %8s\n' kernel lowering ms speedup
+for kernel in dot saxpy; do
+  scalar=$(($(millis "$yonto" run --task-threads=1 --no-simd "$kernel.yo") -
+    fill))
+  vector=$(($(millis "$yonto" run --task-threads=1 "$kernel.yo") - fill))
+  printf '%-8s %-8s %10s %8s\n' "$kernel" scalar "$scalar" 1.00
+  printf '%-8s %-8s %10s %8s\n' "$kernel" vector "$vector" \
+    "$(ratio "$scalar" "$vector")"
+done
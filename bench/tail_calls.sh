@@ -0,0 +1,27 @@
+#!/bin/sh
+# A counter recursing ITERATIONS times (default 10^8) in tail position, run
+# natively after tiering up, compiled on its first call, and built ahead of
+# time. The interpreter runs a hundredth of the iterations for reference.
+#
+#   bench/tail_calls.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+n=${ITERATIONS:-100000000}
+counter() {
+  printf 'count(n, acc) if eq(n, 0) then acc else count(sub(n, 1), add(acc, n))\n'
+  printf 'main() print(count(%s, 0))\n' "$1"
+}
+counter "$n" > count.yo
+counter "$((n / 100))" > short.yo
+"$yonto" build -o count count.yo
+
+row() {
+  ms=$(millis "$@")
+  printf '%-12s %12s %10s %10s\n' "$mode" "$iterations" "$ms" \
+    "$(ratio "$((ms * 1000000))" "$iterations")"
+}
+printf '%-12s %12s %10s %10s\n' mode iterations ms ns/iter
+mode=run iterations=$n row "$yonto" run count.yo
+mode=lazy-jit iterations=$n row "$yonto" run --lazy-jit count.yo
+mode=build iterations=$n row ./count
+mode=no-jit iterations=$((n / 100)) row "$yonto" run --no-jit short.yo
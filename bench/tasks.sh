@@ -0,0 +1,28 @@
+#!/bin/sh
+# Latency of spawning a task and awaiting it right away, and throughput of
+# many tasks spawned before any is awaited, against --task-threads. Zero
+# threads runs each task when it is awaited.
+#
+#   bench/tasks.sh <yonto>
+. "$(dirname "$0")/common.sh"
+
+cat > latency.yo <<'Y'
+id(x) x
+serial(i, acc) if eq(i, 0) then acc else serial(sub(i, 1), add(acc, await(spawn(id, i))))
+main() print(serial(100000, 0))
+Y
+cat > throughput.yo <<'Y'
+sum(i, acc) if eq(i, 0) then acc else sum(sub(i, 1), add(acc, i))
+work(n) sum(2000, n)
+fan(i, first) if eq(i, 0) then first else fan(sub(i, 1), add(mul(spawn(work, i), 0), first))
+awaitall(i, n, acc) if eq(i, n) then acc else awaitall(add(i, 1), n, add(acc, await(i)))
+main() print(awaitall(fan(20000, 0), 20000, 0))
+Y
+
+printf '%-8s %12s %12s\n' threads us/spawn tasks/s
+for n in 0 $(threads); do
+  latency=$(millis "$yonto" run --task-threads="$n" latency.yo)
+  throughput=$(millis "$yonto" run --task-threads="$n" throughput.yo)
+  printf '%-8s %12s %12s\n' "$n" "$(ratio "$latency" 100)" \
+    "$(ratio 20000000 "$throughput")"
+done
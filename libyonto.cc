@@ -0,0 +1,117 @@
+#include "libyonto.h"
+
+#include "yonto.h"
+
+namespace jian {
+
+struct Script::Impl {
+  parsing::Program P{};
+  std::shared_ptr<gcc_jit_result> Code{};
+};
+
+[[noreturn]] static void raise(const char *msg) { throw ScriptError{msg}; }
+
+// Faults of scripts become exceptions for the rest of the process once a host
+// uses the library.
+static void hosted() { FaultHandler.store(raise, std::memory_order_release); }
+
+Script::Script(std::shared_ptr<const Impl> impl) : I{std::move(impl)} {}
+
+Script::~Script() = default;
+
+std::unique_ptr<Script> Script::Compile(const char *path, std::string &error,
+                                        const ScriptOptions &opts) {
+  hosted();
+  opt::Options o{};
+  o.Level = opts.Level;
+  o.Native = opts.Native;
+  auto impl = std::make_shared<Impl>();
+  Driver driver{path};
+  if (!driver.Load(impl->P, o, true)) {
+    error = driver.Diagnostic();
+    return nullptr;
+  }
+  aot::Options a{};
+  a.Code = Driver::Target(o);
+  std::string diagnostic{};
+  auto code = aot::InMemory(impl->P, a, diagnostic);
+  if (auto err = std::get_if<Error>(&code)) {
+    error = std::string{path} + ": " +
+            (diagnostic.empty() ? err->What() : diagnostic);
+    return nullptr;
+  }
+  impl->Code = {std::get<gcc_jit_result *>(code), gcc_jit_result_release};
+  return std::unique_ptr<Script>{new Script{std::move(impl)}};
+}
+
+void *Script::find(const std::string &name, size_t arity) const {
+  for (const auto &d : I->P.Defs) {
+    if (d.Text == name && d.Kind == parsing::DefKind::Fn &&
+        d.Params.size() == arity) {
+      return gcc_jit_result_get_code(I->Code.get(),
+                                     jit::Codegen::Name(d).c_str());
+    }
+  }
+  return nullptr;
+}
+
+struct Isolate::Impl {
+  std::shared_ptr<const Script::Impl> Shared;
+  gc::Options Heap;
+  shell::Options Shell{};
+  eval::Interpreter Interp;
+
+  Impl(std::shared_ptr<const Script::Impl> shared, const jit::Options &opts,
+       const gc::Options &heap)
+      : Shared{std::move(shared)}, Heap{heap},
+        Interp{Shared->P, opts, Heap, Shell} {
+    Interp.Share(Shared->Code);
+  }
+};
+
+Isolate::Isolate(std::unique_ptr<Impl> impl) : I{std::move(impl)} {}
+
+Isolate::~Isolate() = default;
+
+std::unique_ptr<Isolate> Isolate::Create(const Script &script,
+                                         const IsolateOptions &opts) {
+  hosted();
+  jit::Options j{};
+  j.Workers = opts.Threads;
+  gc::Options heap{};
+  heap.MaxBytes = opts.MaxBytes;
+  heap.Nursery = opts.Nursery;
+  // Isolates are meant to run side by side, one thread each.
+  heap.Markers = 1;
+  return std::unique_ptr<Isolate>{
+      new Isolate{std::make_unique<Impl>(script.I, j, heap)}};
+}
+
+bool Isolate::Call(const std::string &name, const std::vector<int64_t> &args,
+                   int64_t &result, std::string &error) {
+  const auto &p = I->Shared->P;
+  for (size_t i = 0; i < p.Defs.size(); i++) {
+    if (p.Defs[i].Text != name) {
+      continue;
+    }
+    Result<int64_t> ret{};
+    try {
+      ret = I->Interp.Invoke(i, args.data(), args.size());
+    } catch (const ScriptError &e) {
+      error = name + ": " + e.what();
+      return false;
+    }
+    if (auto err = std::get_if<Error>(&ret)) {
+      error = name + ": " + err->What();
+      return false;
+    }
+    result = std::get<int64_t>(ret);
+    return true;
+  }
+  error = name + ": function not found";
+  return false;
+}
+
+size_t Isolate::Footprint() const { return I->Interp.Memory().Footprint(); }
+
+} // namespace jian
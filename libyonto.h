@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace jian {
+
+struct ScriptOptions {
+  // Optimization level, as with -O<n>.
+  unsigned Level{2};
+  // Generate code for the host CPU, as with -march=native.
+  bool Native{};
+};
+
+struct IsolateOptions {
+  // Bytes the heap may map, zero for no limit.
+  size_t MaxBytes{};
+  // Bytes allocated between minor collections.
+  size_t Nursery{1 << 20};
+  // Threads running spawned tasks, none to run each one when it is awaited.
+  unsigned Threads{};
+};
+
+// A fault of the script being run, such as division by zero, an index out of
+// bounds or calling something that is not a function. It is thrown out of
+// Function pointers through the native frames of the script, and Isolate::Call
+// returns it as an error. The isolate that raised it can be called again.
+//
+// Other errors still end the process: broken invariants of the runtime,
+// overflowing the native stack and faults inside C functions the script
+// declares extern.
+class ScriptError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+class Isolate;
+
+// A script compiled once into native code, for hosts that call its functions
+// directly. Only functions that compile ahead of time can be looked up, and
+// their parameters and results are all numbers. Lookups may be done from any
+// thread, and the functions found stay valid as long as the script.
+class Script {
+  friend class Isolate;
+  struct Impl;
+  std::shared_ptr<const Impl> I;
+
+  explicit Script(std::shared_ptr<const Impl> impl);
+
+  [[nodiscard]] void *find(const std::string &name, size_t arity) const;
+
+public:
+  // Returns null and describes why in error if the script does not compile.
+  static std::unique_ptr<Script> Compile(const char *path, std::string &error,
+                                         const ScriptOptions &opts = {});
+
+  Script(const Script &) = delete;
+  Script &operator=(const Script &) = delete;
+  ~Script();
+
+  // The native code of the function with as many parameters as Args, or null.
+  // Calling it throws ScriptError on a fault of the script.
+  template <typename... Args>
+  [[nodiscard]] auto Function(const std::string &name) const {
+    static_assert((std::is_same_v<Args, int64_t> && ...),
+                  "script functions take numbers");
+    return reinterpret_cast<int64_t (*)(Args...)>(find(name, sizeof...(Args)));
+  }
+};
+
+// An interpreter of a script with its own heap, stack, compiled code and
+// channels. Isolates share only the definitions and native code of their
+// script, which never change and live as long as any of them, so isolates run
+// on different threads without locks. Each one runs on one thread at a time.
+class Isolate {
+  struct Impl;
+  std::unique_ptr<Impl> I;
+
+  explicit Isolate(std::unique_ptr<Impl> impl);
+
+public:
+  static std::unique_ptr<Isolate> Create(const Script &script,
+                                         const IsolateOptions &opts = {});
+
+  Isolate(const Isolate &) = delete;
+  Isolate &operator=(const Isolate &) = delete;
+  ~Isolate();
+
+  // Runs a function with numbers, natively where the script has native code.
+  // Returns false and describes why in error, for instance when the heap
+  // reaches MaxBytes or the script raises a ScriptError.
+  bool Call(const std::string &name, const std::vector<int64_t> &args,
+            int64_t &result, std::string &error);
+
+  // Bytes mapped by the heap of the isolate.
+  [[nodiscard]] size_t Footprint() const;
+};
+
+} // namespace jian
@@ -0,0 +1,115 @@
+#!/bin/sh
+# Runs every case with the builtin commands and with --external-commands, and
+# compares the output and exit status of the two.
+#
+#   tests/builtins.sh <yonto>
+set -eu
+yonto=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+seq 1 150000 > nums
+seq 1 12 > small
+printf 'a:b:c\nno delimiter\n:x:\nab:cd\nx::y\nlast:line' > fields
+printf 'one two  three\n\tfour\nfive' > words
+printf 'abc\000def\nabc\nxyz\n' > nul
+printf 'abc\377\nabc\n' > badutf
+: > empty
+mkdir adir
+
+failed=0
+check() {
+  printf 'main() print(`%s`)\n' "$1" > case.yo
+  builtin=$("$yonto" run case.yo 2>/dev/null) || true
+  external=$("$yonto" run --external-commands case.yo 2>/dev/null) || true
+  if [ "$builtin" != "$external" ]; then
+    printf 'LC_ALL=%s %s: builtin and external output differ\n' \
+      "$LC_ALL" "$1" >&2
+    printf '%s\n' "$builtin" > builtin.out
+    printf '%s\n' "$external" > external.out
+    diff builtin.out external.out | head -20 >&2 || true
+    failed=1
+  fi
+}
+
+cases() {
+  # Column widths follow the largest count, or 7 for input with unknown size.
+  check 'wc nums'
+  check 'wc -l nums'
+  check 'wc -w words'
+  check 'wc -c small'
+  check 'wc -lc nums'
+  check 'wc -lw words'
+  check 'wc empty'
+  check 'wc < nums'
+  check 'wc -l < small'
+  check 'cat nums | wc'
+  check 'wc adir'
+  check 'wc missing'
+
+  # Exit status is 0 with a match, 1 without and 2 on errors.
+  check 'grep 7 small'
+  check 'grep -c 99 nums'
+  check 'grep -v 1 small'
+  check 'grep -q 149999 nums'
+  check 'grep zz nums'
+  check 'grep -c zz nums'
+  check 'grep -F b:c fields'
+  check 'grep x missing'
+  check 'grep x adir'
+  check 'cat small | grep -v 2'
+  # Binary input: NUL bytes, and bad encodings under UTF-8 locales.
+  check 'grep abc nul'
+  check 'grep -c abc nul'
+  check 'grep -v abc nul'
+  check 'grep xyz nul'
+  check 'grep abc badutf'
+  check 'grep -q abc badutf'
+  check 'grep abc < nul'
+
+  # -s drops lines without the delimiter. Lists take open ranges.
+  check 'cut -d: -f1,3 fields'
+  check 'cut -d: -s -f2 fields'
+  check 'cut -d: -f2- fields'
+  check 'cut -d: -f-2 fields'
+  check 'cut -s -d: -f3- fields'
+  check 'cut -c2-3,5- fields'
+  check 'cut -b-3 fields'
+  check 'cut -c3- words'
+  check 'cut -f2 words'
+  check 'cut -c1 missing'
+
+  check 'head small'
+  check 'head -n 3 nums'
+  check 'head -n3 nums'
+  check 'head -n 0 small'
+  check 'head -c 7 nums'
+  check 'head -c7 nums'
+  check 'head -c 0 nums'
+  check 'head -c 100000 nums'
+  check 'head -c 5 < fields'
+  check 'cat nums | head -c 70000 | wc -c'
+  check 'head adir'
+  check 'head missing'
+
+  check 'cat small fields'
+  check 'cat - < small'
+  check 'cat missing small'
+  check 'sort -r small'
+  check 'sort -u fields fields'
+  check 'tee copy < small'
+  check 'cat nums | tee copy | wc -l'
+  check 'cat copy'
+  check 'cat small | tee -a copy | wc -l'
+  check 'cat copy'
+}
+
+LC_ALL=C
+export LC_ALL
+cases
+if locale -a 2>/dev/null | grep -qi '^c\.utf-\?8$'; then
+  LC_ALL=C.UTF-8
+  cases
+fi
+exit "$failed"
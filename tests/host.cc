@@ -0,0 +1,60 @@
+#include "libyonto.h"
+
+#include <cstdio>
+
+// Calls a script function from the host through its native code and through
+// an isolate, and checks that division by zero is reported as a fault of the
+// script that leaves both usable.
+//
+//   host <script.yo>
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "%s\n", what);
+    failures++;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <script.yo>\n", argv[0]);
+    return 1;
+  }
+  std::string error{};
+  auto script = jian::Script::Compile(argv[1], error);
+  if (!script) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  expect(!script->Function<int64_t>("quot"), "quot found with one parameter");
+  if (auto quot = script->Function<int64_t, int64_t>("quot")) {
+    expect(quot(7, 2) == 3, "native quot(7, 2) is not 3");
+    try {
+      quot(1, 0);
+      expect(false, "native quot(1, 0) returned");
+    } catch (const jian::ScriptError &e) {
+      expect(std::string{e.what()} == "division by zero",
+             "native quot(1, 0) raised another error");
+    }
+    expect(quot(-9, 3) == -3, "native quot(-9, 3) is not -3 after a fault");
+  } else {
+    expect(false, "quot has no native code");
+  }
+
+  auto isolate = jian::Isolate::Create(*script);
+  int64_t result = 0;
+  expect(isolate->Call("quot", {7, 2}, result, error) && result == 3,
+         "isolate quot(7, 2) is not 3");
+  expect(!isolate->Call("quot", {1, 0}, result, error) &&
+             error == "quot: division by zero",
+         "isolate quot(1, 0) did not fail with division by zero");
+  expect(isolate->Call("quot", {-9, 3}, result, error) && result == -3,
+         "isolate quot(-9, 3) is not -3 after a fault");
+  expect(!isolate->Call("missing", {1, 2}, result, error) &&
+             error == "missing: function not found",
+         "isolate found a function the script lacks");
+  return failures ? 1 : 0;
+}
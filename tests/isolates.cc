@@ -0,0 +1,66 @@
+#include "libyonto.h"
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+// Runs two isolates of one script on two threads while a third one with a
+// small heap runs out of memory, which must fail only its own call.
+//
+//   isolates <script.yo>
+
+static std::atomic<int> failures{0};
+
+static void expect(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "%s\n", what);
+    failures++;
+  }
+}
+
+// Sums arrays of growing sizes, each of which the script allocates.
+static void sums(jian::Isolate &isolate) {
+  std::string error{};
+  for (int64_t n = 0; n < 4000; n += 13) {
+    int64_t result = 0;
+    if (!isolate.Call("sum", {n}, result, error)) {
+      fprintf(stderr, "%s\n", error.c_str());
+      failures++;
+      return;
+    }
+    if (result != n * (n - 1) / 2) {
+      expect(false, "sum of an array is wrong");
+      return;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <script.yo>\n", argv[0]);
+    return 1;
+  }
+  std::string error{};
+  auto script = jian::Script::Compile(argv[1], error);
+  if (!script) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  auto first = jian::Isolate::Create(*script);
+  auto second = jian::Isolate::Create(*script);
+  auto small = jian::Isolate::Create(*script, {.MaxBytes = 4 << 20});
+  std::thread a{sums, std::ref(*first)};
+  std::thread b{sums, std::ref(*second)};
+  int64_t result = 0;
+  expect(!small->Call("sum", {10000000}, result, error) &&
+             error == "sum: out of memory",
+         "a heap of 4 MiB held 10^7 numbers");
+  expect(small->Call("sum", {1000}, result, error) && result == 499500,
+         "the small isolate failed after running out of memory");
+  a.join();
+  b.join();
+  expect(first->Footprint() > 0 && second->Footprint() > 0,
+         "the isolates on threads mapped no heap");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+# A profile written by --profile-generate is read back by --profile-use with
+# the same output, and one made from another script is rejected.
+#
+#   tests/profile.sh <yonto>
+set -eu
+yonto=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+cat > hot.yo <<'Y'
+step(x) if lt(rem(x, 7), 5) then add(x, 3) else sub(x, 1)
+loop(i, acc) if eq(i, 0) then acc else loop(sub(i, 1), add(acc, step(i)))
+main() print(loop(100000, 0))
+Y
+cat > other.yo <<'Y'
+twice(x) mul(x, 2)
+main() print(twice(21))
+Y
+
+failed=0
+expected=$("$yonto" run hot.yo)
+out=$("$yonto" run --profile-generate=hot.prof hot.yo)
+if [ "$out" != "$expected" ]; then
+  printf 'generating run printed %s, expected %s\n' "$out" "$expected" >&2
+  failed=1
+fi
+if [ "$(head -n 1 hot.prof)" != "yonto-profile 2" ] ||
+  [ "$(wc -l < hot.prof)" -lt 2 ]; then
+  printf 'unexpected profile:\n' >&2
+  cat hot.prof >&2
+  failed=1
+fi
+out=$("$yonto" run --profile-use=hot.prof hot.yo)
+if [ "$out" != "$expected" ]; then
+  printf 'profiled run printed %s, expected %s\n' "$out" "$expected" >&2
+  failed=1
+fi
+
+if "$yonto" run --profile-use=hot.prof other.yo > other.out 2>&1; then
+  printf 'profile of hot.yo accepted for other.yo\n' >&2
+  failed=1
+elif ! grep -q 'cannot read profile' other.out; then
+  printf 'unexpected rejection:\n' >&2
+  cat other.out >&2
+  failed=1
+fi
+printf 'yonto-profile 1\n' > old.prof
+if "$yonto" run --profile-use=old.prof hot.yo > /dev/null 2>&1; then
+  printf 'profile of version 1 accepted\n' >&2
+  failed=1
+fi
+exit "$failed"
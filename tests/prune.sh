@@ -0,0 +1,43 @@
+#!/bin/sh
+# Definitions main does not reach are dropped from a run and reported by
+# --opt-report, while a shared library keeps every definition written.
+#
+#   tests/prune.sh <yonto>
+set -eu
+yonto=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+cat > prune.yo <<'Y'
+used(x) add(x, 1)
+unused(x) mul(x, 2)
+alsounused(x) unused(x)
+main() print(used(41))
+Y
+
+failed=0
+out=$("$yonto" run --opt-report prune.yo 2> report)
+if [ "$out" != 42 ]; then
+  printf 'prune.yo printed %s\n' "$out" >&2
+  failed=1
+fi
+if ! grep -q '^prune: dropped 2 definitions (unused, alsounused)$' report &&
+  ! grep -q '^prune: dropped 2 definitions (alsounused, unused)$' report; then
+  printf 'unexpected report:\n' >&2
+  cat report >&2
+  failed=1
+fi
+if "$yonto" run -O0 --opt-report prune.yo 2>&1 > /dev/null | grep -q prune:; then
+  printf 'definitions pruned at -O0\n' >&2
+  failed=1
+fi
+
+"$yonto" build --shared -o libprune.so prune.yo
+for name in used unused alsounused; do
+  if ! nm -D --defined-only libprune.so | grep -q " yonto_$name\$"; then
+    printf 'libprune.so does not export yonto_%s\n' "$name" >&2
+    failed=1
+  fi
+done
+exit "$failed"
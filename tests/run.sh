@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs a script and compares its output with the .out file beside it. A
+# script with an .err file beside it instead must fail, with that file as the
+# first line of its error output.
+#
+#   tests/run.sh <yonto> <script.yo> [<run options>...]
+set -eu
+yonto=$1
+script=$2
+shift 2
+error=${script%.yo}.err
+if [ -f "$error" ]; then
+  if actual=$("$yonto" run "$@" "$script" 2>&1 >/dev/null); then
+    printf '%s: expected to fail with\n%s\n' "$script" "$(cat "$error")" >&2
+    exit 1
+  fi
+  actual=$(printf '%s\n' "$actual" | head -n 1)
+  expected=$(cat "$error")
+else
+  actual=$("$yonto" run "$@" "$script")
+  expected=$(cat "${script%.yo}.out")
+fi
+if [ "$actual" != "$expected" ]; then
+  printf '%s: expected\n%s\ngot\n%s\n' "$script" "$expected" "$actual" >&2
+  exit 1
+fi
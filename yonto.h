@@ -1,11 +1,45 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <variant>
+#include <vector>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <libgccjit++.h>
 
@@ -20,25 +54,37 @@ inline static void printStack() {
   int frameNum = backtrace(buf, sizeof(buf) / sizeof(void *));
   char **symbols = backtrace_symbols(buf, frameNum);
 
-  std::cout << "stacktrace:" << std::endl;
+  std::cerr << "stacktrace:" << std::endl;
   for (int i = 0; i < frameNum; ++i) {
-    std::cout << '\t' << symbols[i] << std::endl;
+    std::cerr << '\t' << symbols[i] << std::endl;
   }
 
   free(symbols);
 }
 #else
-inline static void printStack() { printf("(unknown)\n"); }
+inline static void printStack() { fprintf(stderr, "(unknown)\n"); }
 #endif
 
 [[noreturn]] inline static void panic(const char *msg) {
-  std::cout << "panic: " << msg << std::endl << std::endl;
+  std::cerr << "panic: " << msg << std::endl << std::endl;
   printStack();
   exit(1);
 }
 
 [[noreturn]] inline static void unreachable() { panic("unreachable"); }
 
+// Errors of the script being run, as opposed to those of the runtime. Hosts
+// embedding the runtime install a handler that throws, so that a failing
+// script does not end their process. Without one these panic too.
+inline std::atomic<void (*)(const char *msg)> FaultHandler{};
+
+[[noreturn]] inline static void fail(const char *msg) {
+  if (auto handler = FaultHandler.load(std::memory_order_acquire)) {
+    handler(msg);
+  }
+  panic(msg);
+}
+
 #if !__has_feature(address_sanitizer) && !__has_feature(thread_sanitizer) &&   \
     !__has_feature(memory_sanitizer) &&                                        \
     !__has_feature(undefined_behavior_sanitizer)
@@ -370,12 +416,11 @@ inline static void gc_Push(struct gc *gc, struct object *value) {
 
 inline static struct object *gc_Pop(struct gc *gc) {
   if (gc->StackSize <= 0) {
-    printf("Stack overflow\n");
+    printf("Stack underflow\n");
     exit(1);
   }
-  struct object *ret = gc->Stack[gc->StackSize];
   gc->StackSize--;
-  return ret;
+  return gc->Stack[gc->StackSize];
 }
 
 inline static void gc_Mark(struct gc *vm) {
@@ -1284,14 +1329,67 @@ inline static int Driver_Run(struct Driver *d, int argc, const char *argv[]) {
 namespace jian {
 
 class Error {
-  [[maybe_unused]] const char *Msg;
+  const char *Msg;
 
 public:
   explicit Error(const char *msg) : Msg{msg} {}
+
+  [[nodiscard]] const char *What() const { return Msg; }
 };
 
 template <typename T> using Result = std::variant<T, Error>;
 
+enum class Builtin {
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Rem,
+  Eq,
+  Lt,
+  Le,
+  Not,
+  Print,
+  Wait,
+  Spawn,
+  Await,
+  Chan,
+  Send,
+  Recv,
+  Array,
+  Len,
+  Get,
+  Set,
+  ParMap,
+  ParReduce,
+  ParFilter,
+};
+
+struct BuiltinInfo {
+  const char *Name;
+  size_t Arity;
+};
+
+inline constexpr BuiltinInfo Builtins[] = {
+    {"add", 2},  {"sub", 2},   {"mul", 2},   {"div", 2},  {"rem", 2},
+    {"eq", 2},   {"lt", 2},    {"le", 2},    {"not", 1},  {"print", 1},
+    {"wait", 1},    {"spawn", 2},      {"await", 1},      {"chan", 1},
+    {"send", 2},    {"recv", 1},       {"array", 1},      {"len", 1},
+    {"get", 2},     {"set", 3},        {"par_map", 2},    {"par_reduce", 3},
+    {"par_filter", 2},
+};
+
+// Builtins are resolved to negative IDs so they never collide with the IDs
+// handed out by the parser.
+static inline int BuiltinID(Builtin b) { return -1 - static_cast<int>(b); }
+
+static inline std::optional<Builtin> AsBuiltin(int id) {
+  if (id >= 0) {
+    return {};
+  }
+  return static_cast<Builtin>(-1 - id);
+}
+
 namespace parsing {
 
 class IDs {
@@ -1322,6 +1420,7 @@ struct Loc {
 struct Span {
   Loc Start, End;
 
+  Span() = default;
   Span(Loc start, Loc end) : Start{start}, End{end} {}
 };
 
@@ -1335,6 +1434,8 @@ class Source {
 public:
   Source(FILE *file, class IDs &ids) : File{file}, IDs{ids} {}
 
+  [[nodiscard]] struct Loc Here() const { return Loc; }
+
   size_t Size() {
     fseek(File, 0, SEEK_END);
     auto size = ftell(File);
@@ -1409,124 +1510,7334 @@ public:
   }
 };
 
-} // namespace parsing
+enum class ExprKind {
+  App = 1,
+  Ite,
+  Lam,
+  Num,
+  Cmd,
+  Unit,
+  False,
+  True,
+  Unresolved,
+  Resolved,
+  Extern,
+};
 
-class Driver {
-  const char *Filename;
-  FILE *Infile;
-  parsing::IDs IDs{};
+// C types in extern declarations. Pointers are passed as numbers.
+enum class CType {
+  Void,
+  Bool,
+  Char,
+  UChar,
+  Short,
+  UShort,
+  Int,
+  UInt,
+  Long,
+  ULong,
+  Ptr,
+};
+
+inline constexpr const char *CTypes[] = {
+    "void", "bool", "char", "uchar", "short", "ushort",
+    "int",  "uint", "long", "ulong", "ptr",
+};
+
+// Arguments of C functions are all passed in registers.
+inline constexpr size_t MaxExternParams = 6;
+
+struct Param {
+  Span Name{};
+  std::string Text{};
+  int ID{};
+};
+
+enum class WordKind { Text, Hole, Pipe, In, Out, Append };
+
+// A word of a command line. Holes take the next value of the Subs, and
+// redirections hold their file.
+struct Word {
+  WordKind Kind{WordKind::Text};
+  std::string Text{};
+};
+
+struct Expr {
+  ExprKind Kind{ExprKind::Unit};
+  Span Where{};
+  // App: the callee followed by the arguments; Ite: condition, then and else
+  // branches; Lam: the body.
+  std::vector<Expr> Subs{};
+  std::vector<Param> Params{};
+  // Lam: the free variables, filled by closure conversion.
+  std::vector<int> Captures{};
+  // Cmd: the words of the command line, a hole for each of the Subs, and
+  // whether it runs in the background.
+  std::vector<Word> Words{};
+  bool Background{};
+  // Extern: the C types of the arguments followed by the result, and the C
+  // function in Text.
+  std::vector<CType> Signature{};
+  int64_t Num{};
+  int ID{};
+  std::string Text{};
+};
+
+enum class DefKind { Fn = 1, Val };
+
+struct Def {
+  Span Name{};
+  std::string Text{};
+  int ID{};
+  DefKind Kind{DefKind::Fn};
+  std::vector<Param> Params{};
+  Expr Ret{};
+  // Native optimization level from an @O<n> annotation on the function.
+  std::optional<unsigned> Level{};
+};
+
+struct Program {
+  std::vector<Def> Defs{};
+  // Def IDs to their indices in Defs, filled by the resolver.
+  std::unordered_map<int, size_t> Index{};
+
+  [[nodiscard]] std::optional<size_t> Find(int id) const {
+    if (auto it = Index.find(id); it != Index.end()) {
+      return it->second;
+    }
+    return {};
+  }
+};
+
+class Parser {
+  Source &Src;
+  IDs &IDs;
+
+  static bool isIdent(char c) { return (islower(c) && isalpha(c)) || c == '_'; }
+
+  bool fail(Loc loc) {
+    Src.Back(loc);
+    return false;
+  }
+
+  void skipSpaces() { Src.SkipSpaces(); }
+
+  bool word(const char *w) {
+    auto loc = Src.Here();
+    for (auto p = w; *p != '\0'; p++) {
+      if (Src.Peek() != *p) {
+        return fail(loc);
+      }
+      Src.Next();
+    }
+    return true;
+  }
+
+  bool keyword(const char *w) {
+    auto loc = Src.Here();
+    if (!word(w)) {
+      return false;
+    }
+    if (auto c = Src.Peek(); c && isIdent(*c)) {
+      return fail(loc);
+    }
+    return true;
+  }
+
+  bool ident(Span &span, std::string &text) {
+    static constexpr const char *keywords[] = {"if",   "then",  "else",
+                                               "true", "false", "extern"};
+    auto start = Src.Here();
+    auto first = Src.Peek();
+    if (!first || !islower(*first) || !isalpha(*first)) {
+      return false;
+    }
+    text.clear();
+    for (auto c = Src.Peek(); c && isIdent(*c); c = Src.Peek()) {
+      text.push_back(*c);
+      Src.Next();
+    }
+    for (auto k : keywords) {
+      if (text == k) {
+        return fail(start);
+      }
+    }
+    span = Span{start, Src.Here()};
+    return true;
+  }
+
+  bool number(int64_t &num) {
+    auto first = Src.Peek();
+    if (!first || !isdigit(*first)) {
+      return false;
+    }
+    num = 0;
+    while (true) {
+      auto loc = Src.Here();
+      auto c = Src.Peek();
+      if (c == '_') {
+        Src.Next();
+        c = Src.Peek();
+        if (!c || !isdigit(*c)) {
+          Src.Back(loc);
+          return true;
+        }
+      }
+      if (!c || !isdigit(*c)) {
+        return true;
+      }
+      num = num * 10 + (*c - '0');
+      Src.Next();
+    }
+  }
+
+  template <typename F> bool list(F &&item) {
+    auto loc = Src.Here();
+    if (!word("(")) {
+      return false;
+    }
+    skipSpaces();
+    if (word(")")) {
+      return true;
+    }
+    while (true) {
+      if (!item()) {
+        return fail(loc);
+      }
+      skipSpaces();
+      if (word(")")) {
+        return true;
+      }
+      if (!word(",")) {
+        return fail(loc);
+      }
+      skipSpaces();
+    }
+  }
+
+  bool params(std::vector<Param> &ps) {
+    ps.clear();
+    return list([&] {
+      Param p{};
+      if (!ident(p.Name, p.Text)) {
+        return false;
+      }
+      p.ID = IDs.New();
+      ps.push_back(std::move(p));
+      return true;
+    });
+  }
+
+  // A command line between backquotes, split into words at spaces. Single
+  // quotes keep spaces in a word, and a word of $ and a name is replaced with
+  // the number the name refers to. Commands are joined into a pipeline by |,
+  // redirected by <, > and >> followed by a file, and a trailing & runs the
+  // pipeline in the background.
+  bool command(Expr &e) {
+    static constexpr std::pair<const char *, WordKind> operators[] = {
+        {"|", WordKind::Pipe},
+        {"<", WordKind::In},
+        {">", WordKind::Out},
+        {">>", WordKind::Append},
+    };
+    auto start = Src.Here();
+    if (!word("`")) {
+      return false;
+    }
+    e.Kind = ExprKind::Cmd;
+    std::vector<Word> words{};
+    while (true) {
+      while (Src.Peek() == ' ' || Src.Peek() == '\t') {
+        Src.Next();
+      }
+      auto c = Src.Peek();
+      if (!c || *c == '\n') {
+        return fail(start);
+      }
+      if (*c == '`') {
+        Src.Next();
+        break;
+      }
+      if (*c == '$') {
+        Src.Next();
+        Expr ref{};
+        auto loc = Src.Here();
+        if (Span name{}; !ident(name, ref.Text)) {
+          return fail(start);
+        }
+        ref.Kind = ExprKind::Unresolved;
+        ref.Where = Span{loc, Src.Here()};
+        e.Subs.push_back(std::move(ref));
+        words.push_back({WordKind::Hole, {}});
+        continue;
+      }
+      Word w{};
+      auto quoted = false;
+      for (c = Src.Peek(); c && !isspace(*c) && *c != '`'; c = Src.Peek()) {
+        Src.Next();
+        if (*c != '\'') {
+          w.Text.push_back(*c);
+          continue;
+        }
+        quoted = true;
+        for (c = Src.Next(); c != '\''; c = Src.Next()) {
+          if (!c || *c == '\n') {
+            return fail(start);
+          }
+          w.Text.push_back(*c);
+        }
+      }
+      for (auto [op, kind] : operators) {
+        if (!quoted && w.Text == op) {
+          w.Kind = kind;
+        }
+      }
+      if (!quoted && w.Text == "&") {
+        e.Background = true;
+        continue;
+      }
+      if (e.Background) {
+        return fail(start);
+      }
+      words.push_back(std::move(w));
+    }
+
+    // Redirections take the file that follows, and every command of the
+    // pipeline starts with the program.
+    auto program = true;
+    for (size_t i = 0; i < words.size(); i++) {
+      auto &w = words[i];
+      switch (w.Kind) {
+      case WordKind::Text:
+      case WordKind::Hole:
+        if (program && w.Kind == WordKind::Hole) {
+          return fail(start);
+        }
+        program = false;
+        e.Words.push_back(std::move(w));
+        break;
+      case WordKind::Pipe:
+        if (program) {
+          return fail(start);
+        }
+        program = true;
+        e.Words.push_back(std::move(w));
+        break;
+      case WordKind::In:
+      case WordKind::Out:
+      case WordKind::Append:
+        if (i + 1 == words.size() || words[i + 1].Kind != WordKind::Text) {
+          return fail(start);
+        }
+        w.Text = std::move(words[++i].Text);
+        e.Words.push_back(std::move(w));
+        break;
+      }
+    }
+    if (program) {
+      return fail(start);
+    }
+    return true;
+  }
+
+  bool end() {
+    while (Src.Peek() == ' ' || Src.Peek() == '\t' || Src.Peek() == '\r') {
+      Src.Next();
+    }
+    auto c = Src.Peek();
+    if (!c) {
+      return true;
+    }
+    if (*c == ';' || *c == '\n') {
+      Src.Next();
+      return true;
+    }
+    return false;
+  }
+
+  // Only references and parenthesized expressions can be applied.
+  bool primary(Expr &e, bool &applicable) {
+    auto start = Src.Here();
+    e = Expr{};
+    applicable = false;
+
+    if (keyword("if")) {
+      e.Kind = ExprKind::Ite;
+      e.Subs.resize(3);
+      skipSpaces();
+      if (!ParseExpr(e.Subs[0])) {
+        return fail(start);
+      }
+      skipSpaces();
+      if (!keyword("then")) {
+        return fail(start);
+      }
+      skipSpaces();
+      if (!ParseExpr(e.Subs[1])) {
+        return fail(start);
+      }
+      skipSpaces();
+      if (!keyword("else")) {
+        return fail(start);
+      }
+      skipSpaces();
+      if (!ParseExpr(e.Subs[2])) {
+        return fail(start);
+      }
+      e.Where = Span{start, Src.Here()};
+      return true;
+    }
+
+    if (params(e.Params)) {
+      skipSpaces();
+      if (word("=>")) {
+        e.Kind = ExprKind::Lam;
+        e.Subs.resize(1);
+        skipSpaces();
+        if (ParseExpr(e.Subs[0])) {
+          e.Where = Span{start, Src.Here()};
+          return true;
+        }
+      }
+      fail(start);
+      e = Expr{};
+    }
+
+    if (number(e.Num)) {
+      e.Kind = ExprKind::Num;
+    } else if (command(e)) {
+    } else if (word("()")) {
+      e.Kind = ExprKind::Unit;
+    } else if (keyword("false")) {
+      e.Kind = ExprKind::False;
+    } else if (keyword("true")) {
+      e.Kind = ExprKind::True;
+    } else if (Span name{}; ident(name, e.Text)) {
+      e.Kind = ExprKind::Unresolved;
+      applicable = true;
+    } else if (word("(")) {
+      applicable = true;
+      skipSpaces();
+      if (!ParseExpr(e)) {
+        return fail(start);
+      }
+      skipSpaces();
+      if (!word(")")) {
+        return fail(start);
+      }
+    } else {
+      return false;
+    }
+    e.Where = Span{start, Src.Here()};
+    return true;
+  }
 
 public:
-  explicit Driver(const char *file) : Filename{file} {
-    Infile = fopen(Filename, "r");
-    if (!Infile) {
-      perror("open file error");
-      panic("create driver error");
+  Parser(Source &src, class IDs &ids) : Src{src}, IDs{ids} {}
+
+  bool ParseExpr(Expr &e) {
+    auto start = Src.Here();
+    auto applicable = false;
+    if (!primary(e, applicable)) {
+      return false;
+    }
+    if (!applicable) {
+      return true;
+    }
+    auto loc = Src.Here();
+    skipSpaces();
+    if (Src.Peek() != '(') {
+      Src.Back(loc);
+      return true;
+    }
+    Expr app{};
+    app.Kind = ExprKind::App;
+    app.Subs.push_back(std::move(e));
+    auto ok = list([&] {
+      Expr arg{};
+      if (!ParseExpr(arg)) {
+        return false;
+      }
+      app.Subs.push_back(std::move(arg));
+      return true;
+    });
+    if (!ok) {
+      e = std::move(app.Subs[0]);
+      Src.Back(loc);
+      return true;
     }
+    app.Where = Span{start, Src.Here()};
+    e = std::move(app);
+    return true;
   }
 
-  ~Driver() {
-    int ret = fclose(Infile);
-    if (ret != 0) {
-      perror("close file error");
-      panic("close driver error");
+  // An optional colon and C type after a name, long if there is none.
+  bool annotation(CType &t) {
+    auto loc = Src.Here();
+    while (Src.Peek() == ' ' || Src.Peek() == '\t') {
+      Src.Next();
+    }
+    t = CType::Long;
+    if (!word(":")) {
+      Src.Back(loc);
+      return true;
     }
+    skipSpaces();
+    Span span{};
+    std::string text{};
+    if (!ident(span, text)) {
+      return fail(loc);
+    }
+    for (size_t i = 0; i < std::size(CTypes); i++) {
+      if (text == CTypes[i]) {
+        t = static_cast<CType>(i);
+        return true;
+      }
+    }
+    return fail(loc);
   }
 
-  static void PrintVersion() {
-    std::cout << "JianScript v" << JIAN_VERSION_MAJOR << '.'
-              << JIAN_VERSION_MINOR << '.' << JIAN_VERSION_PATCH << std::endl;
+  // extern name(param: type, ...): type declares a C function of the same
+  // name. The definition calls it with its params, so it is used like any
+  // other function.
+  bool external(Def &d) {
+    auto start = Src.Here();
+    if (!ident(d.Name, d.Text)) {
+      return false;
+    }
+    skipSpaces();
+    Expr call{};
+    call.Kind = ExprKind::Extern;
+    call.Text = d.Text;
+    auto ok = list([&] {
+      Param p{};
+      CType t{};
+      if (!ident(p.Name, p.Text) || !annotation(t) || t == CType::Void) {
+        return false;
+      }
+      p.ID = IDs.New();
+      Expr ref{};
+      ref.Kind = ExprKind::Unresolved;
+      ref.Text = p.Text;
+      ref.Where = p.Name;
+      call.Subs.push_back(std::move(ref));
+      call.Signature.push_back(t);
+      d.Params.push_back(std::move(p));
+      return true;
+    });
+    CType result{};
+    if (!ok || d.Params.size() > MaxExternParams || !annotation(result)) {
+      return fail(start);
+    }
+    call.Signature.push_back(result);
+    call.Where = Span{start, Src.Here()};
+    d.Kind = DefKind::Fn;
+    d.Ret = std::move(call);
+    return true;
   }
 
-  static void PrintUsage() {
-    std::cout << "JianScript programming language." << std::endl
-              << std::endl
-              << "Usage:" << std::endl
-              << std::endl
-              << "\tjian <command> [<arguments>]" << std::endl
-              << std::endl
-              << "Commands are:" << std::endl
-              << std::endl
-              << "\tjian run\t\trun a script with the default JIT mode"
-              << std::endl
-              << "\tjian help\tprint this usage message" << std::endl
-              << "\tjian version\tprint the version" << std::endl
-              << std::endl;
-  }
-};
-
-static inline void create_code(gccjit::context ctxt) {
-  gccjit::type void_type = ctxt.get_type(GCC_JIT_TYPE_VOID);
-  gccjit::type const_char_ptr_type = ctxt.get_type(GCC_JIT_TYPE_CONST_CHAR_PTR);
-  gccjit::param param_name = ctxt.new_param(const_char_ptr_type, "name");
-  std::vector<gccjit::param> func_params;
-  func_params.push_back(param_name);
-  gccjit::function func = ctxt.new_function(GCC_JIT_FUNCTION_EXPORTED,
-                                            void_type, "greet", func_params, 0);
-
-  gccjit::param param_format = ctxt.new_param(const_char_ptr_type, "format");
-  std::vector<gccjit::param> printf_params;
-  printf_params.push_back(param_format);
-  gccjit::function printf_func = ctxt.new_function(
-      GCC_JIT_FUNCTION_IMPORTED, ctxt.get_type(GCC_JIT_TYPE_INT), "printf",
-      printf_params, 1);
-
-  gccjit::block block = func.new_block();
-  block.add_eval(
-      ctxt.new_call(printf_func, ctxt.new_rvalue("Hello, %s!\n"), param_name));
-  block.end_with_return();
+  bool ParseDef(Def &d) {
+    auto start = Src.Here();
+    if (keyword("extern")) {
+      skipSpaces();
+      if (!external(d) || !end()) {
+        return fail(start);
+      }
+      d.ID = IDs.New();
+      return true;
+    }
+    if (word("@O")) {
+      int64_t level{};
+      if (!number(level) || level > 3) {
+        return fail(start);
+      }
+      d.Level = static_cast<unsigned>(level);
+      skipSpaces();
+    }
+    if (!ident(d.Name, d.Text)) {
+      return fail(start);
+    }
+    skipSpaces();
+    if (Src.Peek() == '=' && !word("=>")) {
+      Src.Next();
+      d.Kind = DefKind::Val;
+    } else if (params(d.Params)) {
+      d.Kind = DefKind::Fn;
+    } else {
+      return fail(start);
+    }
+    if (d.Level && d.Kind != DefKind::Fn) {
+      return fail(start);
+    }
+    skipSpaces();
+    if (!ParseExpr(d.Ret) || !end()) {
+      return false;
+    }
+    d.ID = IDs.New();
+    return true;
+  }
+
+  bool ParseProgram(Program &p) {
+    skipSpaces();
+    while (Src.Peek()) {
+      Def d{};
+      if (!ParseDef(d)) {
+        return false;
+      }
+      p.Defs.push_back(std::move(d));
+      skipSpaces();
+    }
+    return true;
+  }
+};
+
+enum class Resolution { OK, NotFound, Duplicate };
+
+static inline const char *Resolution_ToString(Resolution state) {
+  switch (state) {
+  case Resolution::OK:
+    return "resolved successfully";
+  case Resolution::NotFound:
+    return "variable not found";
+  case Resolution::Duplicate:
+    return "duplicate variable";
+  }
+  unreachable();
 }
 
-static inline int main(int argc, const char *argv[]) {
-  (void)argc;
-  (void)argv;
+class Resolver {
+  std::unordered_map<std::string, int> Globals{};
+  std::vector<std::unordered_map<std::string, int>> Locals{};
 
-  recovery();
+  bool failed(Resolution state, const Span &span, const std::string &text) {
+    State = state;
+    NameSpan = span;
+    NameText = text;
+    return false;
+  }
 
-  /*
-  struct Driver driver;
-  if (Driver_Run(&driver, argc, argv) != 0) {
-    return 1;
+  bool enter(const std::vector<Param> &params) {
+    std::unordered_map<std::string, int> scope{};
+    for (const auto &p : params) {
+      if (!scope.emplace(p.Text, p.ID).second) {
+        return failed(Resolution::Duplicate, p.Name, p.Text);
+      }
+    }
+    Locals.push_back(std::move(scope));
+    return true;
+  }
+
+  std::optional<int> lookup(const std::string &name) {
+    for (auto it = Locals.rbegin(); it != Locals.rend(); it++) {
+      if (auto found = it->find(name); found != it->end()) {
+        return found->second;
+      }
+    }
+    if (auto found = Globals.find(name); found != Globals.end()) {
+      return found->second;
+    }
+    for (size_t i = 0; i < std::size(Builtins); i++) {
+      if (name == Builtins[i].Name) {
+        return BuiltinID(static_cast<Builtin>(i));
+      }
+    }
+    return {};
   }
-  */
 
-  gccjit::context ctxt;
-  gcc_jit_result *result;
+public:
+  Resolution State{Resolution::OK};
+  Span NameSpan{};
+  std::string NameText{};
+
+  bool ResolveExpr(Expr &e) {
+    switch (e.Kind) {
+    case ExprKind::App:
+    case ExprKind::Ite:
+    case ExprKind::Cmd:
+    case ExprKind::Extern:
+      for (auto &sub : e.Subs) {
+        if (!ResolveExpr(sub)) {
+          return false;
+        }
+      }
+      return true;
+    case ExprKind::Lam: {
+      if (!enter(e.Params)) {
+        return false;
+      }
+      auto ok = ResolveExpr(e.Subs[0]);
+      Locals.pop_back();
+      return ok;
+    }
+    case ExprKind::Unresolved: {
+      auto id = lookup(e.Text);
+      if (!id) {
+        return failed(Resolution::NotFound, e.Where, e.Text);
+      }
+      e.Kind = ExprKind::Resolved;
+      e.ID = *id;
+      return true;
+    }
+    case ExprKind::Num:
+    case ExprKind::Unit:
+    case ExprKind::False:
+    case ExprKind::True:
+      return true;
+    case ExprKind::Resolved:
+      unreachable();
+    }
+    unreachable();
+  }
 
-  /* Get a "context" object for working with the library.  */
-  ctxt = gccjit::context::acquire();
+  bool ResolveProgram(Program &p) {
+    for (size_t i = 0; i < p.Defs.size(); i++) {
+      const auto &d = p.Defs[i];
+      if (!Globals.emplace(d.Text, d.ID).second) {
+        return failed(Resolution::Duplicate, d.Name, d.Text);
+      }
+      p.Index.emplace(d.ID, i);
+    }
+    for (auto &d : p.Defs) {
+      if (!enter(d.Params)) {
+        return false;
+      }
+      auto ok = ResolveExpr(d.Ret);
+      Locals.pop_back();
+      if (!ok) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
 
-  /* Set some options on the context.
-     Turn this on to see the code being generated, in assembler form.  */
-  ctxt.set_bool_option(GCC_JIT_BOOL_OPTION_DUMP_GENERATED_CODE, 0);
+} // namespace parsing
 
-  /* Populate the context.  */
-  create_code(ctxt);
+namespace opt {
+
+struct Options {
+  unsigned Level{2};
+  // Largest value definition, in nodes, that is inlined at its references.
+  size_t InlineBudget{16};
+  bool Report{};
+  // Profile files written by an instrumented run and read to guide the
+  // compilers.
+  const char *ProfileGenerate{};
+  const char *ProfileUse{};
+  // Native code: -O also picks the GCC optimization level, capped at 3.
+  bool Native{};
+  bool Debug{};
+  const char *Dump{};
+  // C libraries providing extern functions, by their -l names.
+  std::vector<const char *> Libraries{};
+};
 
-  /* Compile the code.  */
-  result = ctxt.compile();
-  if (!result) {
-    fprintf(stderr, "NULL result");
-    exit(1);
+static inline size_t Size(const parsing::Expr &e) {
+  size_t n = 1;
+  for (const auto &sub : e.Subs) {
+    n += Size(sub);
   }
+  return n;
+}
 
-  ctxt.release();
+static inline size_t Size(const parsing::Program &p) {
+  size_t n = 0;
+  for (const auto &d : p.Defs) {
+    n += Size(d.Ret);
+  }
+  return n;
+}
 
-  /* Extract the generated code from "result".  */
-  typedef void (*fn_type)(const char *);
-  auto greet =
-      reinterpret_cast<fn_type>(gcc_jit_result_get_code(result, "greet"));
-  if (!greet) {
-    fprintf(stderr, "NULL greet");
-    exit(1);
+static inline void Substitute(parsing::Expr &e,
+                              const std::unordered_map<int, parsing::Expr> &s) {
+  if (e.Kind == parsing::ExprKind::Resolved) {
+    if (auto it = s.find(e.ID); it != s.end()) {
+      e = it->second;
+    }
+    return;
+  }
+  for (auto &sub : e.Subs) {
+    Substitute(sub, s);
   }
+}
 
-  /* Now call the generated function: */
-  greet("JianScript");
-  fflush(stdout);
+// Gives every binder in the expression a fresh ID, extending the renaming
+// that is applied to references.
+static inline void Freshen(parsing::Expr &e, parsing::IDs &ids,
+                           std::unordered_map<int, int> &renamed) {
+  if (e.Kind == parsing::ExprKind::Resolved) {
+    if (auto it = renamed.find(e.ID); it != renamed.end()) {
+      e.ID = it->second;
+    }
+    return;
+  }
+  for (auto &param : e.Params) {
+    auto id = ids.New();
+    renamed[param.ID] = id;
+    param.ID = id;
+  }
+  for (auto &sub : e.Subs) {
+    Freshen(sub, ids, renamed);
+  }
+}
 
-  gcc_jit_result_release(result);
-  return 0;
+// Partial evaluation over the resolved program: folds builtins applied to
+// literals and conditionals on literals, inlines small constant value
+// definitions and beta-reduces lambdas applied to trivial arguments.
+class Simplifier {
+  parsing::Program &P;
+  parsing::IDs &IDs;
+  const Options &Opts;
+  enum class Visit { No, Active, Done };
+  std::vector<Visit> Visited;
+
+  static bool literal(const parsing::Expr &e) {
+    using parsing::ExprKind;
+    return e.Kind == ExprKind::Num || e.Kind == ExprKind::Unit ||
+           e.Kind == ExprKind::False || e.Kind == ExprKind::True;
+  }
+
+  static int64_t number(const parsing::Expr &e) {
+    return e.Kind == parsing::ExprKind::Num ? e.Num
+                                            : e.Kind == parsing::ExprKind::True;
+  }
+
+  static parsing::Expr num(int64_t n, const parsing::Span &where) {
+    parsing::Expr e{};
+    e.Kind = parsing::ExprKind::Num;
+    e.Num = n;
+    e.Where = where;
+    return e;
+  }
+
+  bool fold(parsing::Expr &e, Builtin op) {
+    for (size_t i = 1; i < e.Subs.size(); i++) {
+      if (!literal(e.Subs[i])) {
+        return false;
+      }
+    }
+    if (Builtins[static_cast<size_t>(op)].Arity != e.Subs.size() - 1) {
+      return false;
+    }
+    auto x = number(e.Subs[1]);
+    auto y = e.Subs.size() > 2 ? number(e.Subs[2]) : 0;
+    // Folds wrap like the interpreter.
+    auto ux = static_cast<uint64_t>(x), uy = static_cast<uint64_t>(y);
+    int64_t n = 0;
+    switch (op) {
+    case Builtin::Add:
+      n = static_cast<int64_t>(ux + uy);
+      break;
+    case Builtin::Sub:
+      n = static_cast<int64_t>(ux - uy);
+      break;
+    case Builtin::Mul:
+      n = static_cast<int64_t>(ux * uy);
+      break;
+    case Builtin::Div:
+    case Builtin::Rem:
+      // Leave the division to fail or wrap at run time.
+      if (y == 0 || (y == -1 && x == INT64_MIN)) {
+        return false;
+      }
+      n = op == Builtin::Div ? x / y : x % y;
+      break;
+    case Builtin::Eq:
+      n = x == y;
+      break;
+    case Builtin::Lt:
+      n = x < y;
+      break;
+    case Builtin::Le:
+      n = x <= y;
+      break;
+    case Builtin::Not:
+      n = x == 0;
+      break;
+    case Builtin::Print:
+    case Builtin::Wait:
+    case Builtin::Spawn:
+    case Builtin::Await:
+    case Builtin::Chan:
+    case Builtin::Send:
+    case Builtin::Recv:
+    case Builtin::Array:
+    case Builtin::Len:
+    case Builtin::Get:
+    case Builtin::Set:
+    case Builtin::ParMap:
+    case Builtin::ParReduce:
+    case Builtin::ParFilter:
+      return false;
+    }
+    e = num(n, e.Where);
+    Folded++;
+    return true;
+  }
+
+  // Value definitions are simplified on first use and inlined when they are
+  // small and pure: literals, references to functions and closed lambdas.
+  std::optional<parsing::Expr> value(size_t index) {
+    auto &d = P.Defs[index];
+    if (d.Kind != parsing::DefKind::Val || Visited[index] == Visit::Active) {
+      return {};
+    }
+    if (Visited[index] == Visit::No) {
+      Visited[index] = Visit::Active;
+      simplify(d.Ret);
+      Visited[index] = Visit::Done;
+    }
+    const auto &v = d.Ret;
+    auto pure = literal(v) || v.Kind == parsing::ExprKind::Lam ||
+                (v.Kind == parsing::ExprKind::Resolved && !P.Find(v.ID)) ||
+                (v.Kind == parsing::ExprKind::Resolved &&
+                 P.Defs[*P.Find(v.ID)].Kind == parsing::DefKind::Fn);
+    if (!pure || Size(v) > Opts.InlineBudget) {
+      return {};
+    }
+    return v;
+  }
+
+  static bool trivial(const parsing::Expr &e) {
+    return literal(e) || e.Kind == parsing::ExprKind::Resolved;
+  }
+
+  void simplify(parsing::Expr &e) {
+    using parsing::ExprKind;
+    for (auto &sub : e.Subs) {
+      simplify(sub);
+    }
+    switch (e.Kind) {
+    case ExprKind::Resolved:
+      if (auto index = P.Find(e.ID)) {
+        if (auto v = value(*index)) {
+          auto where = e.Where;
+          e = *v;
+          e.Where = where;
+          // Every copy of a lambda binds its own IDs.
+          std::unordered_map<int, int> renamed{};
+          Freshen(e, IDs, renamed);
+          Inlined++;
+        }
+      }
+      return;
+    case ExprKind::Ite:
+      if (literal(e.Subs[0])) {
+        auto branch = number(e.Subs[0]) != 0 ? 1 : 2;
+        auto taken = std::move(e.Subs[static_cast<size_t>(branch)]);
+        e = std::move(taken);
+        Branches++;
+      }
+      return;
+    case ExprKind::App: {
+      auto &f = e.Subs[0];
+      if (f.Kind == ExprKind::Resolved) {
+        if (auto op = AsBuiltin(f.ID)) {
+          fold(e, *op);
+        }
+        return;
+      }
+      if (f.Kind != ExprKind::Lam || f.Params.size() != e.Subs.size() - 1) {
+        return;
+      }
+      for (size_t i = 1; i < e.Subs.size(); i++) {
+        if (!trivial(e.Subs[i])) {
+          return;
+        }
+      }
+      std::unordered_map<int, parsing::Expr> s{};
+      for (size_t i = 0; i < f.Params.size(); i++) {
+        s.emplace(f.Params[i].ID, std::move(e.Subs[i + 1]));
+      }
+      auto body = std::move(f.Subs[0]);
+      Substitute(body, s);
+      e = std::move(body);
+      Reduced++;
+      simplify(e);
+      return;
+    }
+    case ExprKind::Lam:
+    case ExprKind::Num:
+    case ExprKind::Cmd:
+    case ExprKind::Unit:
+    case ExprKind::False:
+    case ExprKind::True:
+    case ExprKind::Unresolved:
+    case ExprKind::Extern:
+      return;
+    }
+  }
+
+public:
+  size_t Folded{}, Branches{}, Inlined{}, Reduced{};
+
+  Simplifier(parsing::Program &p, parsing::IDs &ids, const Options &opts)
+      : P{p}, IDs{ids}, Opts{opts}, Visited(p.Defs.size(), Visit::No) {}
+
+  void Simplify() {
+    for (size_t i = 0; i < P.Defs.size(); i++) {
+      if (Visited[i] != Visit::No) {
+        continue;
+      }
+      Visited[i] = Visit::Active;
+      simplify(P.Defs[i].Ret);
+      Visited[i] = Visit::Done;
+    }
+  }
+};
+
+// Collects the local variables an expression refers to without binding them,
+// in order of first occurrence.
+static inline void FreeVars(const parsing::Program &p, const parsing::Expr &e,
+                            std::vector<int> &bound, std::vector<int> &free) {
+  using parsing::ExprKind;
+  if (e.Kind == ExprKind::Resolved) {
+    if (AsBuiltin(e.ID) || p.Find(e.ID) ||
+        std::find(bound.begin(), bound.end(), e.ID) != bound.end() ||
+        std::find(free.begin(), free.end(), e.ID) != free.end()) {
+      return;
+    }
+    free.push_back(e.ID);
+    return;
+  }
+  auto n = bound.size();
+  for (const auto &param : e.Params) {
+    bound.push_back(param.ID);
+  }
+  for (const auto &sub : e.Subs) {
+    FreeVars(p, sub, bound, free);
+  }
+  bound.resize(n);
+}
+
+static inline parsing::Expr Ref(int id) {
+  parsing::Expr e{};
+  e.Kind = parsing::ExprKind::Resolved;
+  e.ID = id;
+  return e;
+}
+
+// Lambdas refer to their lifted copy, if any.
+static inline void References(const parsing::Program &p,
+                              const parsing::Expr &e,
+                              std::vector<size_t> &refs) {
+  if (e.Kind == parsing::ExprKind::Resolved ||
+      e.Kind == parsing::ExprKind::Lam) {
+    if (auto index = p.Find(e.ID)) {
+      refs.push_back(*index);
+    }
+  }
+  for (const auto &sub : e.Subs) {
+    References(p, sub, refs);
+  }
+}
+
+// Drops the definitions not reachable from the roots and returns the names of
+// those dropped.
+static inline std::vector<std::string>
+Prune(parsing::Program &p, const std::vector<size_t> &roots) {
+  std::vector<bool> live(p.Defs.size());
+  std::vector<size_t> work{};
+  for (auto root : roots) {
+    live[root] = true;
+    work.push_back(root);
+  }
+  while (!work.empty()) {
+    auto index = work.back();
+    work.pop_back();
+    std::vector<size_t> refs{};
+    References(p, p.Defs[index].Ret, refs);
+    for (auto ref : refs) {
+      if (!live[ref]) {
+        live[ref] = true;
+        work.push_back(ref);
+      }
+    }
+  }
+
+  std::vector<std::string> pruned{};
+  std::vector<parsing::Def> defs{};
+  p.Index.clear();
+  for (size_t i = 0; i < p.Defs.size(); i++) {
+    if (!live[i]) {
+      pruned.push_back(std::move(p.Defs[i].Text));
+      continue;
+    }
+    p.Index.emplace(p.Defs[i].ID, defs.size());
+    defs.push_back(std::move(p.Defs[i]));
+  }
+  p.Defs = std::move(defs);
+  return pruned;
+}
+
+// Closure conversion. Lambdas that provably do not escape are lambda-lifted
+// into top-level functions that take their captured variables as extra
+// parameters, so they need no closure at all:
+//
+//  * immediately applied lambdas become direct calls;
+//  * lambdas passed to a known function that only ever calls that parameter
+//    (or passes it on unchanged to itself) become calls to a copy of the
+//    function specialized for the lifted lambda.
+//
+// The remaining lambdas record their free variables, so that the closures
+// built at run time are flat and capture only what is used. Those passed to
+// the parallel builtins also get a lifted copy, whose ID they keep, for the
+// native loops over arrays.
+class Closures {
+  parsing::Program &P;
+  parsing::IDs &IDs;
+  size_t Lambdas{};
+
+  static bool onlyCalled(const parsing::Expr &e, int param, size_t arity,
+                         int self, size_t position) {
+    using parsing::ExprKind;
+    if (e.Kind == ExprKind::Resolved) {
+      return e.ID != param;
+    }
+    if (e.Kind == ExprKind::App && e.Subs[0].Kind == ExprKind::Resolved) {
+      const auto &f = e.Subs[0];
+      if (f.ID == param && e.Subs.size() - 1 != arity) {
+        return false;
+      }
+      for (size_t i = 1; i < e.Subs.size(); i++) {
+        // Recursive calls must pass the parameter along, any other function
+        // there would be specialized again without end.
+        if (f.ID == self && i - 1 == position) {
+          if (e.Subs[i].Kind == ExprKind::Resolved && e.Subs[i].ID == param) {
+            continue;
+          }
+          return false;
+        }
+        if (!onlyCalled(e.Subs[i], param, arity, self, position)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    for (const auto &sub : e.Subs) {
+      if (!onlyCalled(sub, param, arity, self, position)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t add(parsing::Def d) {
+    d.ID = IDs.New();
+    auto index = P.Defs.size();
+    P.Index.emplace(d.ID, index);
+    P.Defs.push_back(std::move(d));
+    return index;
+  }
+
+  // Lifts the lambda into a new top-level function whose leading parameters
+  // are the captured variables, which are returned.
+  std::pair<int, std::vector<int>> lift(parsing::Expr lam) {
+    std::vector<int> bound{}, captures{};
+    FreeVars(P, lam, bound, captures);
+
+    parsing::Def d{};
+    d.Text = "lambda" + std::to_string(++Lambdas);
+    d.Kind = parsing::DefKind::Fn;
+    d.Name = lam.Where;
+    std::unordered_map<int, int> renamed{};
+    for (auto id : captures) {
+      parsing::Param param{};
+      param.ID = IDs.New();
+      param.Text = "c" + std::to_string(param.ID);
+      renamed[id] = param.ID;
+      d.Params.push_back(std::move(param));
+    }
+    d.Ret = std::move(lam.Subs[0]);
+    for (auto &param : lam.Params) {
+      auto id = IDs.New();
+      renamed[param.ID] = id;
+      param.ID = id;
+      d.Params.push_back(std::move(param));
+    }
+    Freshen(d.Ret, IDs, renamed);
+    auto id = add(std::move(d));
+    return {P.Defs[id].ID, captures};
+  }
+
+  // Rewrites calls of the lambda parameter into calls of the lifted function,
+  // and recursive calls into calls of the specialization.
+  static void specialize(parsing::Expr &e, int param, int self, size_t position,
+                         int lifted, int specialized,
+                         const std::vector<int> &captures) {
+    using parsing::ExprKind;
+    for (auto &sub : e.Subs) {
+      specialize(sub, param, self, position, lifted, specialized, captures);
+    }
+    if (e.Kind != ExprKind::App || e.Subs[0].Kind != ExprKind::Resolved) {
+      return;
+    }
+    auto &f = e.Subs[0];
+    if (f.ID == param) {
+      f.ID = lifted;
+      std::vector<parsing::Expr> xs{};
+      for (auto id : captures) {
+        xs.push_back(Ref(id));
+      }
+      e.Subs.insert(e.Subs.begin() + 1, xs.begin(), xs.end());
+    } else if (f.ID == self && e.Subs.size() > position + 1 &&
+               e.Subs[position + 1].Kind == ExprKind::Resolved &&
+               e.Subs[position + 1].ID == param) {
+      f.ID = specialized;
+      e.Subs.erase(e.Subs.begin() + static_cast<long>(position) + 1);
+      for (auto id : captures) {
+        e.Subs.push_back(Ref(id));
+      }
+    }
+  }
+
+  bool passLambda(parsing::Expr &app, size_t current) {
+    using parsing::ExprKind;
+    auto callee = P.Find(app.Subs[0].ID);
+    if (!callee || *callee == current ||
+        P.Defs[*callee].Kind != parsing::DefKind::Fn ||
+        P.Defs[*callee].Params.size() != app.Subs.size() - 1) {
+      return false;
+    }
+    for (size_t k = 0; k + 1 < app.Subs.size(); k++) {
+      auto &lam = app.Subs[k + 1];
+      if (lam.Kind != ExprKind::Lam) {
+        continue;
+      }
+      const auto &g = P.Defs[*callee];
+      if (!onlyCalled(g.Ret, g.Params[k].ID, lam.Params.size(), g.ID, k)) {
+        continue;
+      }
+
+      // Copy the callee before lifting, which appends to the definitions.
+      parsing::Def spec{};
+      spec.Kind = parsing::DefKind::Fn;
+      spec.Name = g.Name;
+      spec.Params = g.Params;
+      spec.Ret = g.Ret;
+      spec.Text = g.Text;
+      spec.Level = g.Level;
+      auto self = g.ID;
+      auto [lifted, captures] = lift(std::move(lam));
+      spec.Text += "_" + P.Defs[*P.Find(lifted)].Text;
+      std::unordered_map<int, int> renamed{};
+      for (auto &param : spec.Params) {
+        auto id = IDs.New();
+        renamed[param.ID] = id;
+        param.ID = id;
+      }
+      auto param = spec.Params[k].ID;
+      spec.Params.erase(spec.Params.begin() + static_cast<long>(k));
+      std::vector<int> params{};
+      for (size_t i = 0; i < captures.size(); i++) {
+        parsing::Param p{};
+        p.ID = IDs.New();
+        p.Text = "c" + std::to_string(p.ID);
+        params.push_back(p.ID);
+        spec.Params.push_back(std::move(p));
+      }
+      Freshen(spec.Ret, IDs, renamed);
+      auto index = add(std::move(spec));
+      auto &s = P.Defs[index];
+      specialize(s.Ret, param, self, k, lifted, s.ID, params);
+
+      app.Subs[0].ID = s.ID;
+      app.Subs.erase(app.Subs.begin() + static_cast<long>(k) + 1);
+      for (auto id : captures) {
+        app.Subs.push_back(Ref(id));
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // Builtins passed to the parallel builtins are wrapped into lambdas first.
+  void parallel(parsing::Expr &app) {
+    using parsing::ExprKind;
+    auto op = AsBuiltin(app.Subs[0].ID);
+    if (!op ||
+        (*op != Builtin::ParMap && *op != Builtin::ParReduce &&
+         *op != Builtin::ParFilter) ||
+        app.Subs.size() < 2) {
+      return;
+    }
+    auto &f = app.Subs[1];
+    if (f.Kind == ExprKind::Resolved) {
+      auto b = AsBuiltin(f.ID);
+      if (!b) {
+        return;
+      }
+      parsing::Expr lam{}, call{};
+      lam.Kind = ExprKind::Lam;
+      lam.Where = call.Where = f.Where;
+      call.Kind = ExprKind::App;
+      call.Subs.push_back(f);
+      for (size_t i = 0; i < Builtins[static_cast<size_t>(*b)].Arity; i++) {
+        parsing::Param param{};
+        param.ID = IDs.New();
+        param.Text = "x" + std::to_string(param.ID);
+        call.Subs.push_back(Ref(param.ID));
+        lam.Params.push_back(std::move(param));
+      }
+      lam.Subs.push_back(std::move(call));
+      f = std::move(lam);
+    }
+    if (f.Kind != ExprKind::Lam) {
+      return;
+    }
+    std::vector<int> bound{};
+    f.Captures.clear();
+    FreeVars(P, f, bound, f.Captures);
+    f.ID = lift(f).first;
+  }
+
+  void convert(parsing::Expr &e, size_t current) {
+    using parsing::ExprKind;
+    for (auto &sub : e.Subs) {
+      convert(sub, current);
+    }
+    if (e.Kind == ExprKind::App && e.Subs[0].Kind == ExprKind::Lam &&
+        e.Subs[0].Params.size() == e.Subs.size() - 1) {
+      auto [lifted, captures] = lift(std::move(e.Subs[0]));
+      e.Subs[0] = Ref(lifted);
+      std::vector<parsing::Expr> xs{};
+      for (auto id : captures) {
+        xs.push_back(Ref(id));
+      }
+      e.Subs.insert(e.Subs.begin() + 1, xs.begin(), xs.end());
+      return;
+    }
+    if (e.Kind == ExprKind::App && e.Subs[0].Kind == ExprKind::Resolved) {
+      parallel(e);
+      while (passLambda(e, current)) {
+      }
+      return;
+    }
+    if (e.Kind == ExprKind::Lam) {
+      std::vector<int> bound{};
+      e.Captures.clear();
+      FreeVars(P, e, bound, e.Captures);
+    }
+  }
+
+public:
+  Closures(parsing::Program &p, parsing::IDs &ids) : P{p}, IDs{ids} {}
+
+  // Definitions added while converting are converted in turn.
+  void Convert() {
+    for (size_t i = 0; i < P.Defs.size(); i++) {
+      auto body = std::move(P.Defs[i].Ret);
+      convert(body, i);
+      P.Defs[i].Ret = std::move(body);
+    }
+  }
+};
+
+} // namespace opt
+
+namespace pgo {
+
+struct Site {
+  std::atomic<uint64_t> Count{}, Taken{};
+};
+
+// What a site counts: calls and loop iterations of a function, calls of a call
+// site, or evaluations and then-branches taken of a conditional.
+enum class SiteKind : uint8_t { Entry, Call, Branch };
+
+// Execution counts of every function and of every call and conditional in
+// their bodies. Spans alone do not tell sites apart: a lifted lambda starts
+// where it is called, and specialized copies share the spans of the original.
+// Sites are therefore keyed by definition, kind and span, and numbered among
+// the sites with the same key. Sites are created up front so that native code
+// can count through stable addresses while the compiler thread reads the table,
+// and they are found by node, since the program does not move once loaded.
+class Profile {
+  struct Key {
+    std::string Def{};
+    SiteKind Kind{};
+    size_t Start{}, End{}, Nth{};
+
+    auto operator<=>(const Key &) const = default;
+  };
+
+  std::map<Key, Site> Sites{};
+  std::unordered_map<const void *, Site *> Nodes{};
+
+  void add(const void *node, Key key) {
+    while (Sites.contains(key)) {
+      key.Nth++;
+    }
+    Nodes.emplace(node, &Sites[key]);
+  }
+
+  void prepare(const std::string &def, const parsing::Expr &e) {
+    using parsing::ExprKind;
+    if (e.Kind == ExprKind::App || e.Kind == ExprKind::Ite) {
+      auto kind = e.Kind == ExprKind::App ? SiteKind::Call : SiteKind::Branch;
+      add(&e, {def, kind, e.Where.Start.Pos, e.Where.End.Pos, 0});
+    }
+    for (const auto &sub : e.Subs) {
+      prepare(def, sub);
+    }
+  }
+
+  [[nodiscard]] Site *find(const void *node) const {
+    auto it = Nodes.find(node);
+    return it == Nodes.end() ? nullptr : it->second;
+  }
+
+public:
+  // Counts below this are too few to base a decision on.
+  static constexpr uint64_t MinSamples = 100;
+  static constexpr uint64_t HotCalls = 1000;
+
+  // Must come before Load, which adds to the sites prepared here.
+  void Prepare(const parsing::Program &p) {
+    for (const auto &d : p.Defs) {
+      add(&d, {d.Text, SiteKind::Entry, d.Name.Start.Pos, d.Name.End.Pos, 0});
+      prepare(d.Text, d.Ret);
+    }
+  }
+
+  template <typename Node> Site &At(const Node &node) {
+    auto site = find(&node);
+    if (!site) {
+      panic("profile site not prepared");
+    }
+    return *site;
+  }
+
+  template <typename Node>
+  [[nodiscard]] const Site *Find(const Node &node) const {
+    return find(&node);
+  }
+
+  [[nodiscard]] std::optional<bool> Likely(const parsing::Expr &ite) const {
+    auto site = Find(ite);
+    if (!site) {
+      return {};
+    }
+    auto count = site->Count.load(std::memory_order_relaxed);
+    if (count < MinSamples) {
+      return {};
+    }
+    auto taken = site->Taken.load(std::memory_order_relaxed);
+    auto ratio = static_cast<double>(taken) / static_cast<double>(count);
+    if (ratio >= 0.9) {
+      return true;
+    }
+    if (ratio <= 0.1) {
+      return false;
+    }
+    return {};
+  }
+
+  [[nodiscard]] bool Hot(const parsing::Expr &call) const {
+    auto site = Find(call);
+    return site && site->Count.load(std::memory_order_relaxed) >= HotCalls;
+  }
+
+  // Adds the counts of a saved profile to the prepared sites. A profile with
+  // a site the program does not have was made from another script, and is
+  // rejected.
+  bool Load(const char *path) {
+    auto f = fopen(path, "r");
+    if (!f) {
+      return false;
+    }
+    unsigned version = 0;
+    auto ok = fscanf(f, "yonto-profile %u\n", &version) == 1 && version == 2;
+    char def[256];
+    unsigned kind = 0;
+    size_t start = 0, end = 0, nth = 0;
+    unsigned long long count = 0, taken = 0;
+    while (ok && fscanf(f, "%255s %u %zu %zu %zu %llu %llu\n", def, &kind,
+                        &start, &end, &nth, &count, &taken) == 7) {
+      if (kind > static_cast<unsigned>(SiteKind::Branch)) {
+        ok = false;
+        break;
+      }
+      auto it = Sites.find({def, static_cast<SiteKind>(kind), start, end, nth});
+      if (it == Sites.end()) {
+        ok = false;
+        break;
+      }
+      it->second.Count.fetch_add(count, std::memory_order_relaxed);
+      it->second.Taken.fetch_add(taken, std::memory_order_relaxed);
+    }
+    ok = ok && feof(f);
+    fclose(f);
+    return ok;
+  }
+
+  bool Save(const char *path) const {
+    auto f = fopen(path, "w");
+    if (!f) {
+      return false;
+    }
+    fprintf(f, "yonto-profile 2\n");
+    for (const auto &[k, site] : Sites) {
+      auto count = site.Count.load(std::memory_order_relaxed);
+      if (count != 0) {
+        fprintf(f, "%s %u %zu %zu %zu %llu %llu\n", k.Def.c_str(),
+                static_cast<unsigned>(k.Kind), k.Start, k.End, k.Nth,
+                static_cast<unsigned long long>(count),
+                static_cast<unsigned long long>(
+                    site.Taken.load(std::memory_order_relaxed)));
+      }
+    }
+    return fclose(f) == 0;
+  }
+};
+
+} // namespace pgo
+
+namespace mem {
+
+// Hands out the pages heaps are made of. Freed pages are kept in a small cache
+// of the freeing thread, then in a pool shared by every heap in the process,
+// so that heaps growing and shrinking do not go back to the system each time.
+// Pages of other sizes are not cached.
+class PagePool {
+  std::mutex Mu{};
+  std::vector<void *> Free{};
+  std::atomic<uint64_t> Hits{}, Misses{};
+
+  struct Cache {
+    std::vector<void *> Pages{};
+
+    ~Cache() {
+      for (auto p : Pages) {
+        Shared().put(p);
+      }
+    }
+  };
+
+  static Cache &local() {
+    static thread_local Cache cache{};
+    return cache;
+  }
+
+  void put(void *p) {
+    std::lock_guard lock{Mu};
+    if (Free.size() >= MaxShared) {
+      free(p);
+      return;
+    }
+    Free.push_back(p);
+  }
+
+public:
+  static constexpr size_t PageSize = 256 * 1024;
+  static constexpr size_t MaxCached = 16;
+  static constexpr size_t MaxShared = 256;
+
+  PagePool() = default;
+  PagePool(const PagePool &) = delete;
+  PagePool &operator=(const PagePool &) = delete;
+
+  ~PagePool() {
+    for (auto p : Free) {
+      free(p);
+    }
+  }
+
+  static PagePool &Shared() {
+    static PagePool pool{};
+    return pool;
+  }
+
+  void *Get(size_t bytes) {
+    if (bytes == PageSize) {
+      auto &cache = local().Pages;
+      if (!cache.empty()) {
+        auto p = cache.back();
+        cache.pop_back();
+        Hits.fetch_add(1, std::memory_order_relaxed);
+        return p;
+      }
+      std::lock_guard lock{Mu};
+      if (!Free.empty()) {
+        auto p = Free.back();
+        Free.pop_back();
+        Hits.fetch_add(1, std::memory_order_relaxed);
+        return p;
+      }
+    }
+    Misses.fetch_add(1, std::memory_order_relaxed);
+    return aligned_alloc(PageSize, bytes);
+  }
+
+  void Put(void *p, size_t bytes) {
+    if (bytes != PageSize) {
+      free(p);
+      return;
+    }
+    auto &cache = local().Pages;
+    if (cache.size() < MaxCached) {
+      cache.push_back(p);
+      return;
+    }
+    put(p);
+  }
+
+  [[nodiscard]] uint64_t Hit() const { return Hits.load(); }
+  [[nodiscard]] uint64_t Missed() const { return Misses.load(); }
+};
+
+// A Chase-Lev deque of pointers to work items. The owner pushes and pops at
+// the bottom, other threads steal from the top. Arrays that were grown out of
+// are kept until the deque is destroyed, since a thief may still be reading
+// one.
+template <typename T> class Deque {
+  static_assert(std::is_pointer_v<T>);
+
+  struct Array {
+    size_t Mask{};
+    std::unique_ptr<std::atomic<T>[]> Items{};
+
+    explicit Array(size_t cap)
+        : Mask{cap - 1}, Items{new std::atomic<T>[cap]} {}
+  };
+
+  std::atomic<int64_t> Head{0}, Tail{0};
+  std::atomic<Array *> Items;
+  std::vector<std::unique_ptr<Array>> Arrays{};
+
+  Array *grow(Array *a, int64_t head, int64_t tail) {
+    auto bigger = std::make_unique<Array>((a->Mask + 1) * 2);
+    for (auto i = head; i < tail; i++) {
+      auto k = static_cast<size_t>(i);
+      bigger->Items[k & bigger->Mask].store(
+          a->Items[k & a->Mask].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+    a = bigger.get();
+    Arrays.push_back(std::move(bigger));
+    Items.store(a, std::memory_order_release);
+    return a;
+  }
+
+public:
+  Deque() {
+    Arrays.push_back(std::make_unique<Array>(1024));
+    Items.store(Arrays.back().get(), std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] bool Empty() const {
+    return Head.load(std::memory_order_acquire) >=
+           Tail.load(std::memory_order_acquire);
+  }
+
+  void Push(T o) {
+    auto tail = Tail.load(std::memory_order_relaxed);
+    auto head = Head.load(std::memory_order_acquire);
+    auto a = Items.load(std::memory_order_relaxed);
+    if (tail - head > static_cast<int64_t>(a->Mask)) {
+      a = grow(a, head, tail);
+    }
+    a->Items[static_cast<size_t>(tail) & a->Mask].store(
+        o, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    Tail.store(tail + 1, std::memory_order_relaxed);
+  }
+
+  T Pop() {
+    auto tail = Tail.load(std::memory_order_relaxed) - 1;
+    auto a = Items.load(std::memory_order_relaxed);
+    Tail.store(tail, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto head = Head.load(std::memory_order_relaxed);
+    if (head > tail) {
+      Tail.store(tail + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    auto o = a->Items[static_cast<size_t>(tail) & a->Mask].load(
+        std::memory_order_relaxed);
+    if (head == tail) {
+      if (!Head.compare_exchange_strong(head, head + 1,
+                                        std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        o = nullptr;
+      }
+      Tail.store(tail + 1, std::memory_order_relaxed);
+    }
+    return o;
+  }
+
+  T Steal() {
+    auto head = Head.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto tail = Tail.load(std::memory_order_acquire);
+    if (head >= tail) {
+      return nullptr;
+    }
+    auto a = Items.load(std::memory_order_acquire);
+    auto o = a->Items[static_cast<size_t>(head) & a->Mask].load(
+        std::memory_order_relaxed);
+    if (!Head.compare_exchange_strong(head, head + 1,
+                                      std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return o;
+  }
+};
+
+} // namespace mem
+
+namespace task {
+
+// A spawned call of a compiled function of one argument. Tasks never suspend:
+// one runs to completion on the stack of whichever thread picks it up, so it
+// costs no more than the call and a slot in a deque.
+struct Task {
+  int64_t (*Code)(void *data, int64_t arg){};
+  void *Data{};
+  int64_t Arg{};
+  int64_t Result{};
+  // A fault of the script, raised again where the task is awaited.
+  std::exception_ptr Error{};
+  std::atomic<bool> Done{};
+};
+
+class Channels;
+
+// Runs tasks on a fixed set of workers started on the first spawn. Each worker
+// runs the tasks it spawns last in first out from its own deque and steals
+// from the others when it runs dry. Tasks spawned by other threads go through
+// a shared queue, those deferred to the thread owning the pool through one of
+// its own.
+//
+// Threads never run other tasks while they wait, since a task picked up there
+// could be waiting in turn for the one below it on the stack. A worker that
+// blocks with tasks still queued and no worker idle is replaced by a spare
+// thread instead. Only the owner runs deferred tasks, and only while it waits
+// inside a SafePoint. Without workers every thread runs the queued ones.
+class Pool {
+  static constexpr size_t External = SIZE_MAX;
+  static constexpr size_t MaxSpares = 256;
+
+  unsigned Threads;
+  Channels &Chans;
+  std::atomic<std::thread::id> Owner{std::this_thread::get_id()};
+  std::vector<std::unique_ptr<mem::Deque<Task *>>> Deques{};
+  std::mutex Mu{};
+  std::condition_variable Cv{};
+  std::vector<std::thread> Workers{};
+  std::deque<Task *> Injected{};
+  bool Quit{};
+  // Only touched by the owner.
+  std::deque<Task *> Deferred{};
+  bool Safe{};
+  // Tasks spawned and not taken yet, those of them in the shared queue, the
+  // workers about to sleep and the spares started so far.
+  std::atomic<size_t> Queued{}, Inbox{}, Sleeping{}, Spares{};
+
+  // The pool of the current thread, for its owner and its workers, and the
+  // deque of a worker.
+  static inline thread_local Pool *Self{};
+  static inline thread_local size_t Index{External};
+
+  static void finish(Task &t) {
+    try {
+      t.Result = t.Code(t.Data, t.Arg);
+    } catch (...) {
+      t.Error = std::current_exception();
+    }
+    t.Done.store(true, std::memory_order_release);
+    t.Done.notify_all();
+  }
+
+  bool run(size_t self) {
+    Task *t = nullptr;
+    if (self != External) {
+      t = Deques[self]->Pop();
+    }
+    if (!t && Inbox.load() > 0) {
+      std::lock_guard lock{Mu};
+      if (!Injected.empty()) {
+        t = Injected.front();
+        Injected.pop_front();
+        Inbox.fetch_sub(1);
+      }
+    }
+    for (size_t i = 1; !t && i <= Deques.size(); i++) {
+      t = Deques[(self + i) % Deques.size()]->Steal();
+    }
+    if (!t) {
+      return false;
+    }
+    Queued.fetch_sub(1);
+    finish(*t);
+    return true;
+  }
+
+  void worker(size_t self) {
+    Self = this;
+    Index = self;
+    while (true) {
+      if (run(self)) {
+        continue;
+      }
+      std::unique_lock lock{Mu};
+      Sleeping.fetch_add(1);
+      Cv.wait(lock, [this] { return Quit || Queued.load() > 0; });
+      Sleeping.fetch_sub(1);
+      if (Quit) {
+        return;
+      }
+    }
+  }
+
+  // Whether the thread did some work instead of blocking.
+  bool block() {
+    auto owner = std::this_thread::get_id() == Owner.load();
+    if (owner && Safe && !Deferred.empty()) {
+      auto t = Deferred.front();
+      Deferred.pop_front();
+      Safe = false;
+      finish(*t);
+      Safe = true;
+      return true;
+    }
+    if (Threads == 0) {
+      return run(External);
+    }
+    if (!owner && Queued.load() > 0 && Sleeping.load() == 0 &&
+        Spares.load() < MaxSpares) {
+      std::lock_guard lock{Mu};
+      if (!Quit) {
+        Spares.fetch_add(1);
+        Workers.emplace_back([this] { worker(External); });
+      }
+    }
+    return false;
+  }
+
+public:
+  Pool(unsigned threads, Channels &chans) : Threads{threads}, Chans{chans} {}
+
+  Pool(const Pool &) = delete;
+  Pool &operator=(const Pool &) = delete;
+
+  ~Pool() {
+    {
+      std::lock_guard lock{Mu};
+      Quit = true;
+    }
+    Cv.notify_all();
+    // Spares may still be joining, so the workers are not iterated unlocked.
+    while (true) {
+      std::thread t{};
+      {
+        std::lock_guard lock{Mu};
+        if (Workers.empty()) {
+          break;
+        }
+        t = std::move(Workers.back());
+        Workers.pop_back();
+      }
+      t.join();
+    }
+  }
+
+  // Makes the calling thread the owner of the pool until the scope ends, so
+  // that pools can be run from other threads than the one creating them and
+  // several pools can share a thread.
+  class Scope {
+    Pool *Saved;
+
+  public:
+    explicit Scope(Pool &pool) : Saved{Self} {
+      Self = &pool;
+      pool.Owner.store(std::this_thread::get_id());
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    ~Scope() { Self = Saved; }
+  };
+
+  void Spawn(Task *t) {
+    if (Deques.empty() && Threads > 0) {
+      for (unsigned i = 0; i < Threads; i++) {
+        Deques.push_back(std::make_unique<mem::Deque<Task *>>());
+      }
+      std::lock_guard lock{Mu};
+      for (unsigned i = 0; i < Threads; i++) {
+        Workers.emplace_back([this, i] { worker(i); });
+      }
+    }
+    Queued.fetch_add(1);
+    if (Self == this && Index != External) {
+      Deques[Index]->Push(t);
+    } else {
+      std::lock_guard lock{Mu};
+      Injected.push_back(t);
+      Inbox.fetch_add(1);
+    }
+    // A worker either sees the task before sleeping or is counted here.
+    if (Sleeping.load() > 0) {
+      {
+        std::lock_guard lock{Mu};
+      }
+      Cv.notify_one();
+    }
+  }
+
+  // Lets the owner run deferred tasks while it waits, until the scope ends.
+  // The interpreter opens one only where the script itself waits, with every
+  // reference it holds on its root stack. Deferred tasks therefore never run
+  // under native frames or in the middle of a builtin, and they run outside
+  // of any safe point themselves until they wait in turn.
+  class SafePoint {
+    Pool &Owned;
+    bool Saved;
+
+  public:
+    explicit SafePoint(Pool &pool) : Owned{pool}, Saved{pool.Safe} {
+      Owned.Safe = true;
+    }
+
+    SafePoint(const SafePoint &) = delete;
+    SafePoint &operator=(const SafePoint &) = delete;
+
+    ~SafePoint() { Owned.Safe = Saved; }
+  };
+
+  // Leaves the task to the owner, for tasks that must run on its thread.
+  void Defer(Task *t) { Deferred.push_back(t); }
+
+  void Await(Task &t) {
+    while (!t.Done.load(std::memory_order_acquire)) {
+      if (!block()) {
+        t.Done.wait(false, std::memory_order_acquire);
+      }
+    }
+    if (t.Error) {
+      std::rethrow_exception(t.Error);
+    }
+  }
+
+  // Called before the current thread blocks on something else than a task.
+  static bool Block() { return Self && Self->block(); }
+
+  // The channels of the pool the current thread runs for.
+  static Channels &Local() {
+    if (!Self) {
+      panic("no task pool on this thread");
+    }
+    return Self->Chans;
+  }
+};
+
+// A bounded queue of numbers.
+class Channel {
+  std::mutex Mu{};
+  std::condition_variable Cv{};
+  std::deque<int64_t> Items{};
+  size_t Capacity;
+
+  template <typename Ready>
+  void block(std::unique_lock<std::mutex> &lock, Ready ready) {
+    while (!ready()) {
+      lock.unlock();
+      auto worked = Pool::Block();
+      lock.lock();
+      if (!worked && !ready()) {
+        Cv.wait(lock);
+      }
+    }
+  }
+
+public:
+  explicit Channel(size_t capacity) : Capacity{capacity} {}
+
+  void Send(int64_t x) {
+    std::unique_lock lock{Mu};
+    block(lock, [this] { return Items.size() < Capacity; });
+    Items.push_back(x);
+    lock.unlock();
+    Cv.notify_all();
+  }
+
+  int64_t Recv() {
+    std::unique_lock lock{Mu};
+    block(lock, [this] { return !Items.empty(); });
+    auto x = Items.front();
+    Items.pop_front();
+    lock.unlock();
+    Cv.notify_all();
+    return x;
+  }
+};
+
+// Channels are numbered and live as long as their pool, so native code can
+// pass them around as plain numbers.
+class Channels {
+  std::mutex Mu{};
+  std::deque<Channel> All{};
+
+public:
+  int64_t Open(int64_t capacity) {
+    std::lock_guard lock{Mu};
+    All.emplace_back(static_cast<size_t>(std::max<int64_t>(capacity, 1)));
+    return static_cast<int64_t>(All.size() - 1);
+  }
+
+  Channel &At(int64_t id) {
+    std::lock_guard lock{Mu};
+    if (id < 0 || static_cast<size_t>(id) >= All.size()) {
+      fail("not a channel");
+    }
+    return All[static_cast<size_t>(id)];
+  }
+};
+
+static inline int64_t Open(int64_t capacity) {
+  return Pool::Local().Open(capacity);
+}
+
+static inline int64_t Send(int64_t c, int64_t x) {
+  Pool::Local().At(c).Send(x);
+  return 0;
+}
+
+static inline int64_t Recv(int64_t c) { return Pool::Local().At(c).Recv(); }
+
+} // namespace task
+
+namespace eval {
+class Interpreter;
+} // namespace eval
+
+namespace jit {
+
+static_assert(sizeof(long) == sizeof(int64_t));
+
+struct Slot;
+
+// Every top-level function is entered through its slot, either by the
+// interpreter trampoline or by native code installed on tier-up.
+using Entry = int64_t (*)(Slot *self, const int64_t *args);
+
+enum class Tier { Interpreted, Queued, Native, Failed };
+
+struct Slot {
+  std::atomic<Entry> Code{};
+  std::atomic<uint32_t> Calls{}, Loops{};
+  std::atomic<Tier> State{Tier::Interpreted};
+  const parsing::Def *Def{};
+  eval::Interpreter *Owner{};
+  // Whether the code generator can lower the function: first-order bodies
+  // over numbers, builtins and calls to other eligible functions.
+  bool Eligible{};
+};
+
+static_assert(std::atomic<Entry>::is_always_lock_free);
+static_assert(sizeof(std::atomic<Entry>) == sizeof(Entry));
+
+enum class Pattern { Map, Reduce, Filter };
+
+// The loop of a parallel builtin over n numbers from in, calling a function
+// with its captured values in front of each element. Maps write the results
+// to out, filters write the elements they keep there and return how many, and
+// reductions fold the elements into acc and return it.
+using Kernel = int64_t (*)(const int64_t *in, int64_t *out, int64_t n,
+                           int64_t acc, const int64_t *captures);
+
+enum class Mode {
+  Off,
+  // Interpret first and compile hot functions in the background.
+  Tiered,
+  // Compile every function on its first call.
+  Lazy,
+};
+
+// How every context is compiled, from the common -O, -march=native, -g and
+// --dump= options. Functions annotated with @O<n> get their own contexts.
+struct Target {
+  int Level{2};
+  bool Native{};
+  bool Debug{};
+  // Directory that receives a C-like dump of each context before compiling.
+  std::string Dump{};
+
+  void Configure(gccjit::context &ctxt,
+                 const std::optional<unsigned> &level) const {
+    ctxt.set_int_option(GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL,
+                        level ? static_cast<int>(*level) : Level);
+    if (Native) {
+      ctxt.add_command_line_option("-march=native");
+    }
+    if (Debug) {
+      ctxt.set_bool_option(GCC_JIT_BOOL_OPTION_DEBUGINFO, 1);
+    }
+    // Faults and running out of memory in the interpreter unwind through
+    // native frames.
+    ctxt.add_command_line_option("-fexceptions");
+    // Arithmetic wraps as in the interpreter, so a function gives the same
+    // results before and after it tiers up.
+    ctxt.add_command_line_option("-fwrapv");
+  }
+
+  void Write(gccjit::context &ctxt, const std::string &name) const {
+    if (!Dump.empty()) {
+      ctxt.dump_to_file(Dump + "/" + name + ".c", Debug);
+    }
+  }
+};
+
+// Numbers in the widest vector unit of the host, enabling it for the context.
+// Kernels are only compiled under the JIT, so the host is also the target.
+static inline unsigned Lanes(gccjit::context &ctxt) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+    ctxt.add_command_line_option("-mavx512f");
+    ctxt.add_command_line_option("-mavx512dq");
+    return 8;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    ctxt.add_command_line_option("-mavx2");
+    return 4;
+  }
+#endif
+  return 2;
+}
+
+struct Options {
+  Mode JIT{Mode::Tiered};
+  uint32_t CallThreshold{1000};
+  uint32_t LoopThreshold{10000};
+  // Callees up to this many nodes are compiled along with a lazily compiled
+  // caller, at most MaxGroup functions per context.
+  size_t SmallCallee{64};
+  size_t MaxGroup{16};
+  // Threads running spawned tasks, none to run each one when it is awaited.
+  unsigned Workers{std::max(std::thread::hardware_concurrency(), 1U)};
+  // Kernels of the parallel builtins use vector types when they can.
+  bool Vectorize{true};
+  bool Trace{};
+  pgo::Profile *Profile{};
+  bool Instrument{};
+  Target Code{};
+};
+
+static inline void Callees(const parsing::Program &p, const parsing::Expr &e,
+                           std::vector<size_t> &callees) {
+  if (e.Kind == parsing::ExprKind::App &&
+      e.Subs[0].Kind == parsing::ExprKind::Resolved) {
+    if (auto index = p.Find(e.Subs[0].ID)) {
+      callees.push_back(*index);
+    }
+  }
+  for (const auto &sub : e.Subs) {
+    Callees(p, sub, callees);
+  }
+}
+
+// Jobs, tasks and arrays belong to the interpreter. Channels belong to its
+// task pool, which programs built ahead of time do not have.
+static inline bool Lowered(Builtin b, bool aot) {
+  switch (b) {
+  case Builtin::Add:
+  case Builtin::Sub:
+  case Builtin::Mul:
+  case Builtin::Div:
+  case Builtin::Rem:
+  case Builtin::Eq:
+  case Builtin::Lt:
+  case Builtin::Le:
+  case Builtin::Not:
+  case Builtin::Print:
+    return true;
+  case Builtin::Wait:
+  case Builtin::Spawn:
+  case Builtin::Await:
+  case Builtin::Array:
+  case Builtin::Len:
+  case Builtin::Get:
+  case Builtin::Set:
+  case Builtin::ParMap:
+  case Builtin::ParReduce:
+  case Builtin::ParFilter:
+    return false;
+  case Builtin::Chan:
+  case Builtin::Send:
+  case Builtin::Recv:
+    return !aot;
+  }
+  unreachable();
+}
+
+static inline bool isFirstOrder(const parsing::Program &p,
+                                const std::vector<bool> &eligible,
+                                const parsing::Expr &e, bool aot) {
+  using parsing::ExprKind;
+  switch (e.Kind) {
+  case ExprKind::Num:
+  case ExprKind::Unit:
+  case ExprKind::False:
+  case ExprKind::True:
+    return true;
+  case ExprKind::Resolved:
+    // Without lambdas the only locals are the parameters.
+    return !AsBuiltin(e.ID) && !p.Find(e.ID);
+  case ExprKind::Ite:
+  case ExprKind::Extern:
+    for (const auto &sub : e.Subs) {
+      if (!isFirstOrder(p, eligible, sub, aot)) {
+        return false;
+      }
+    }
+    return true;
+  case ExprKind::App: {
+    const auto &f = e.Subs[0];
+    if (f.Kind != ExprKind::Resolved) {
+      return false;
+    }
+    auto arity = e.Subs.size() - 1;
+    if (auto b = AsBuiltin(f.ID)) {
+      if (!Lowered(*b, aot) ||
+          Builtins[static_cast<size_t>(*b)].Arity != arity) {
+        return false;
+      }
+    } else if (auto i = p.Find(f.ID)) {
+      const auto &callee = p.Defs[*i];
+      if (callee.Kind != parsing::DefKind::Fn ||
+          callee.Params.size() != arity || !eligible[*i]) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+    for (size_t i = 1; i < e.Subs.size(); i++) {
+      if (!isFirstOrder(p, eligible, e.Subs[i], aot)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  case ExprKind::Lam:
+  case ExprKind::Cmd:
+  case ExprKind::Unresolved:
+    return false;
+  }
+  unreachable();
+}
+
+// Greatest fixpoint: a function stays eligible as long as everything it calls
+// does, so (mutually) recursive functions can be compiled.
+static inline std::vector<bool> Eligible(const parsing::Program &p,
+                                         bool aot = false) {
+  std::vector<bool> eligible(p.Defs.size(), true);
+  for (size_t i = 0; i < p.Defs.size(); i++) {
+    eligible[i] = p.Defs[i].Kind == parsing::DefKind::Fn;
+  }
+  for (auto changed = true; changed;) {
+    changed = false;
+    for (size_t i = 0; i < p.Defs.size(); i++) {
+      if (eligible[i] && !isFirstOrder(p, eligible, p.Defs[i].Ret, aot)) {
+        eligible[i] = false;
+        changed = true;
+      }
+    }
+  }
+  return eligible;
+}
+
+[[noreturn]] static inline void divideByZero() { fail("division by zero"); }
+
+static inline int64_t print(int64_t n) {
+  printf("%ld\n", static_cast<long>(n));
+  return 0;
+}
+
+// Converts a number to a C type and back the way a C cast does.
+static inline int64_t Narrow(parsing::CType t, int64_t x) {
+  using parsing::CType;
+  switch (t) {
+  case CType::Void:
+    return 0;
+  case CType::Bool:
+    return x != 0;
+  case CType::Char:
+    return static_cast<signed char>(x);
+  case CType::UChar:
+    return static_cast<unsigned char>(x);
+  case CType::Short:
+    return static_cast<int16_t>(x);
+  case CType::UShort:
+    return static_cast<uint16_t>(x);
+  case CType::Int:
+    return static_cast<int32_t>(x);
+  case CType::UInt:
+    return static_cast<uint32_t>(x);
+  case CType::Long:
+  case CType::ULong:
+  case CType::Ptr:
+    return x;
+  }
+  unreachable();
+}
+
+// Calls a C function of n arguments, all narrowed to their types already.
+// Integer arguments of any width travel in whole registers, and the result
+// is narrowed again by the caller since only its low bits are defined.
+using Trampoline = int64_t (*)(void *fn, const int64_t *args);
+
+template <size_t> using Word = int64_t;
+
+template <size_t... I>
+static inline int64_t trampoline(void *fn, const int64_t *args,
+                                 std::index_sequence<I...>) {
+  return reinterpret_cast<int64_t (*)(Word<I>...)>(fn)(args[I]...);
+}
+
+template <size_t N>
+static inline int64_t trampoline(void *fn, const int64_t *args) {
+  return trampoline(fn, args, std::make_index_sequence<N>{});
+}
+
+inline constexpr Trampoline Trampolines[] = {
+    trampoline<0>, trampoline<1>, trampoline<2>, trampoline<3>,
+    trampoline<4>, trampoline<5>, trampoline<6>,
+};
+static_assert(std::size(Trampolines) == parsing::MaxExternParams + 1);
+
+// Lowers a group of functions into a fresh gccjit context. Calls within the
+// group are direct. Under the JIT everything else goes through the callee's
+// slot so that later tier-ups are picked up without recompiling the caller;
+// ahead of time the callee is imported and resolved by the linker.
+class Codegen {
+  gccjit::context &Ctxt;
+  const parsing::Program &P;
+  Slot *Slots;
+  bool AOT;
+  gccjit::type Long, VoidPtr, EntryType;
+  gccjit::function Fn{};
+  std::unordered_map<size_t, gccjit::function> Fns{};
+  std::unordered_map<size_t, std::vector<gccjit::param>> Params{};
+  std::unordered_map<std::string, gccjit::function> Imports{};
+  std::unordered_map<std::string, gccjit::function> Externs{};
+  // The function being defined and the block its self tail calls jump to.
+  size_t Current{};
+  gccjit::block Loop{};
+  std::unordered_map<int, gccjit::rvalue> Locals{};
+  size_t Temps{};
+  // Instrumented code counts into the profile, otherwise the profile guides
+  // branch hints, block layout and which callees get a local copy.
+  pgo::Profile *Profile{};
+  bool Instrument{};
+  std::vector<size_t> Pending{};
+  size_t Copies{};
+  static constexpr size_t MaxCopies = 8;
+  static constexpr size_t MaxCopySize = 64;
+
+  std::string temp() { return "t" + std::to_string(Temps++); }
+
+  gccjit::rvalue ptr(gccjit::type t, const void *p) {
+    return Ctxt.new_rvalue(t, const_cast<void *>(p));
+  }
+
+  gccjit::type fnPtr(gccjit::type ret, std::vector<gccjit::type> params) {
+    std::vector<gcc_jit_type *> inner{};
+    for (auto &t : params) {
+      inner.push_back(t.get_inner_type());
+    }
+    return gccjit::type{gcc_jit_context_new_function_ptr_type(
+        Ctxt.get_inner_context(), nullptr, ret.get_inner_type(),
+        static_cast<int>(inner.size()), inner.data(), 0)};
+  }
+
+  gccjit::rvalue callPtr(gccjit::rvalue f, std::vector<gccjit::rvalue> args) {
+    std::vector<gcc_jit_rvalue *> inner{};
+    for (auto &a : args) {
+      inner.push_back(a.get_inner_rvalue());
+    }
+    return gccjit::rvalue{gcc_jit_context_new_call_through_ptr(
+        Ctxt.get_inner_context(), nullptr, f.get_inner_rvalue(),
+        static_cast<int>(inner.size()), inner.data())};
+  }
+
+  gccjit::function import(const std::string &name, gccjit::type ret,
+                          size_t arity) {
+    if (auto f = Imports.find(name); f != Imports.end()) {
+      return f->second;
+    }
+    std::vector<gccjit::param> params{};
+    for (size_t i = 0; i < arity; i++) {
+      params.push_back(Ctxt.new_param(Long, "x" + std::to_string(i)));
+    }
+    auto f = Ctxt.new_function(GCC_JIT_FUNCTION_IMPORTED, ret, name, params, 0);
+    Imports.emplace(name, f);
+    return f;
+  }
+
+  // Runtime helpers are called through their addresses under the JIT and
+  // linked by name ahead of time, see Runtime.
+  gccjit::rvalue helper(const char *name, void *addr, gccjit::type ret,
+                        std::vector<gccjit::rvalue> args) {
+    if (AOT) {
+      return Ctxt.new_call(import(name, ret, args.size()), args);
+    }
+    std::vector<gccjit::type> params(args.size(), Long);
+    return callPtr(ptr(fnPtr(ret, params), addr), args);
+  }
+
+  gccjit::type cType(parsing::CType t) {
+    using parsing::CType;
+    switch (t) {
+    case CType::Void:
+      return Ctxt.get_type(GCC_JIT_TYPE_VOID);
+    case CType::Bool:
+      return Ctxt.get_type(GCC_JIT_TYPE_BOOL);
+    case CType::Char:
+      return Ctxt.get_type(GCC_JIT_TYPE_SIGNED_CHAR);
+    case CType::UChar:
+      return Ctxt.get_type(GCC_JIT_TYPE_UNSIGNED_CHAR);
+    case CType::Short:
+      return Ctxt.get_type(GCC_JIT_TYPE_SHORT);
+    case CType::UShort:
+      return Ctxt.get_type(GCC_JIT_TYPE_UNSIGNED_SHORT);
+    case CType::Int:
+      return Ctxt.get_type(GCC_JIT_TYPE_INT);
+    case CType::UInt:
+      return Ctxt.get_type(GCC_JIT_TYPE_UNSIGNED_INT);
+    case CType::Long:
+    case CType::Ptr:
+      return Long;
+    case CType::ULong:
+      return Ctxt.get_type(GCC_JIT_TYPE_UNSIGNED_LONG);
+    }
+    unreachable();
+  }
+
+  // Calls the C function of an extern declaration directly, converting the
+  // arguments and the result inline.
+  gccjit::rvalue external(const parsing::Expr &e,
+                          std::vector<gccjit::rvalue> &xs, gccjit::block &b) {
+    auto f = Externs.find(e.Text);
+    if (f == Externs.end()) {
+      std::vector<gccjit::param> params{};
+      for (size_t i = 0; i + 1 < e.Signature.size(); i++) {
+        params.push_back(
+            Ctxt.new_param(cType(e.Signature[i]), "x" + std::to_string(i)));
+      }
+      auto fn = Ctxt.new_function(GCC_JIT_FUNCTION_IMPORTED,
+                                  cType(e.Signature.back()), e.Text, params, 0);
+      f = Externs.emplace(e.Text, fn).first;
+    }
+    std::vector<gccjit::rvalue> args{};
+    for (size_t i = 0; i < xs.size(); i++) {
+      args.push_back(Ctxt.new_cast(xs[i], cType(e.Signature[i])));
+    }
+    auto call = Ctxt.new_call(f->second, args);
+    if (e.Signature.back() == parsing::CType::Void) {
+      b.add_eval(call);
+      return Ctxt.zero(Long);
+    }
+    return bind(b, Ctxt.new_cast(call, Long));
+  }
+
+  // The extern declaration a function is, if any.
+  const parsing::Expr *foreign(size_t callee) const {
+    const auto &ret = P.Defs[callee].Ret;
+    return ret.Kind == parsing::ExprKind::Extern ? &ret : nullptr;
+  }
+
+  // Counters are bumped with relaxed atomic adds, since tasks and kernels run
+  // instrumented code on the pool threads.
+  void count(gccjit::block &b, std::atomic<uint64_t> &counter) {
+    auto add = Ctxt.get_builtin_function("__atomic_fetch_add_8");
+    auto at = Ctxt.new_cast(ptr(Long.get_pointer(), &counter),
+                            add.get_param(0).get_type());
+    b.add_eval(Ctxt.new_call(
+        add, at, Ctxt.new_rvalue(add.get_param(1).get_type(), 1),
+        Ctxt.new_rvalue(add.get_param(2).get_type(), __ATOMIC_RELAXED)));
+  }
+
+  template <typename Node> void count(gccjit::block &b, const Node &node) {
+    if (Instrument) {
+      count(b, Profile->At(node).Count);
+    }
+  }
+
+  // Ends the block with the branch of a conditional. The profile decides the
+  // hint on the condition and which successor is laid out first.
+  std::pair<gccjit::block, gccjit::block>
+  branch(const parsing::Expr &ite, gccjit::rvalue cond, gccjit::block &b) {
+    auto test = Ctxt.new_ne(cond, Ctxt.zero(Long));
+    std::optional<bool> likely{};
+    if (Profile && !Instrument) {
+      likely = Profile->Likely(ite);
+    }
+    if (likely) {
+      auto expect = Ctxt.get_builtin_function("__builtin_expect");
+      auto hinted = Ctxt.new_call(expect, Ctxt.new_cast(test, Long),
+                                  *likely ? Ctxt.one(Long) : Ctxt.zero(Long));
+      test = Ctxt.new_ne(hinted, Ctxt.zero(Long));
+    }
+    gccjit::block then{}, otherwise{};
+    if (likely == false) {
+      otherwise = Fn.new_block(temp());
+      then = Fn.new_block(temp());
+    } else {
+      then = Fn.new_block(temp());
+      otherwise = Fn.new_block(temp());
+    }
+    if (Instrument) {
+      auto &site = Profile->At(ite);
+      count(b, site.Count);
+      count(then, site.Taken);
+    }
+    b.end_with_conditional(test, then, otherwise);
+    return {then, otherwise};
+  }
+
+  void declare(size_t index, enum gcc_jit_function_kind kind,
+               const std::string &name) {
+    const auto &d = P.Defs[index];
+    std::vector<gccjit::param> params{};
+    for (const auto &p : d.Params) {
+      auto param = Ctxt.new_param(Long, p.Text);
+      params.push_back(param);
+      Locals.emplace(p.ID, param);
+    }
+    Params.emplace(index, params);
+    Fns.emplace(index, Ctxt.new_function(kind, Long, name, params, 0));
+  }
+
+  // Small callees at hot call sites get a local copy in this context instead
+  // of going through a slot or an import, so that GCC can inline them.
+  bool copy(const parsing::Expr *site, size_t callee) {
+    if (!Profile || Instrument || Copies >= MaxCopies || !site ||
+        !Profile->Hot(*site) || P.Defs[callee].Level != P.Defs[Current].Level ||
+        opt::Size(P.Defs[callee].Ret) > MaxCopySize) {
+      return false;
+    }
+    Copies++;
+    declare(callee, GCC_JIT_FUNCTION_INTERNAL,
+            Name(P.Defs[callee]) + "_copy");
+    Pending.push_back(callee);
+    return true;
+  }
+
+  gccjit::rvalue bind(gccjit::block &b, gccjit::rvalue value) {
+    auto local = Fn.new_local(Long, temp());
+    b.add_assignment(local, value);
+    return local;
+  }
+
+  gccjit::rvalue builtin(Builtin op, std::vector<gccjit::rvalue> &xs,
+                         gccjit::block &b) {
+    switch (op) {
+    case Builtin::Add:
+      return Ctxt.new_plus(Long, xs[0], xs[1]);
+    case Builtin::Sub:
+      return Ctxt.new_minus(Long, xs[0], xs[1]);
+    case Builtin::Mul:
+      return Ctxt.new_mult(Long, xs[0], xs[1]);
+    case Builtin::Div:
+    case Builtin::Rem: {
+      auto cold = Fn.new_block(temp());
+      auto ok = Fn.new_block(temp());
+      auto negate = Fn.new_block(temp());
+      auto divide = Fn.new_block(temp());
+      auto done = Fn.new_block(temp());
+      auto dividend = bind(b, xs[0]);
+      auto divisor = bind(b, xs[1]);
+      auto result = Fn.new_local(Long, temp());
+      b.end_with_conditional(Ctxt.new_eq(divisor, Ctxt.zero(Long)), cold, ok);
+      cold.add_eval(helper("yonto_divide_by_zero",
+                           reinterpret_cast<void *>(divideByZero),
+                           Ctxt.get_type(GCC_JIT_TYPE_VOID), {}));
+      cold.end_with_jump(ok);
+      // The minimum divided by -1 traps, so -1 negates with wrapping instead.
+      ok.end_with_conditional(
+          Ctxt.new_eq(divisor, Ctxt.new_rvalue(Long, -1)), negate, divide);
+      auto ulong = Ctxt.get_type(GCC_JIT_TYPE_UNSIGNED_LONG);
+      auto negated = Ctxt.new_minus(ulong, Ctxt.zero(ulong),
+                                    Ctxt.new_cast(dividend, ulong));
+      negate.add_assignment(result, op == Builtin::Div
+                                        ? Ctxt.new_cast(negated, Long)
+                                        : Ctxt.zero(Long));
+      negate.end_with_jump(done);
+      divide.add_assignment(result,
+                            op == Builtin::Div
+                                ? Ctxt.new_divide(Long, dividend, divisor)
+                                : Ctxt.new_modulo(Long, dividend, divisor));
+      divide.end_with_jump(done);
+      b = done;
+      return result;
+    }
+    case Builtin::Eq:
+      return Ctxt.new_cast(Ctxt.new_eq(xs[0], xs[1]), Long);
+    case Builtin::Lt:
+      return Ctxt.new_cast(Ctxt.new_lt(xs[0], xs[1]), Long);
+    case Builtin::Le:
+      return Ctxt.new_cast(Ctxt.new_le(xs[0], xs[1]), Long);
+    case Builtin::Not:
+      return Ctxt.new_cast(Ctxt.new_eq(xs[0], Ctxt.zero(Long)), Long);
+    case Builtin::Print:
+      return bind(b, helper("yonto_print", reinterpret_cast<void *>(print),
+                            Long, {xs[0]}));
+    case Builtin::Chan:
+      return bind(b, helper("yonto_chan",
+                            reinterpret_cast<void *>(task::Open), Long,
+                            {xs[0]}));
+    case Builtin::Send:
+      return bind(b, helper("yonto_send", reinterpret_cast<void *>(task::Send),
+                            Long, {xs[0], xs[1]}));
+    case Builtin::Recv:
+      return bind(b, helper("yonto_recv",
+                            reinterpret_cast<void *>(task::Recv), Long,
+                            {xs[0]}));
+    case Builtin::Wait:
+    case Builtin::Spawn:
+    case Builtin::Await:
+    case Builtin::Array:
+    case Builtin::Len:
+    case Builtin::Get:
+    case Builtin::Set:
+    case Builtin::ParMap:
+    case Builtin::ParReduce:
+    case Builtin::ParFilter:
+      break;
+    }
+    unreachable();
+  }
+
+  gccjit::rvalue call(const parsing::Expr *site, size_t callee,
+                      std::vector<gccjit::rvalue> &xs, gccjit::block &b) {
+    if (!Fns.contains(callee)) {
+      copy(site, callee);
+    }
+    if (auto f = Fns.find(callee); f != Fns.end()) {
+      return bind(b, Ctxt.new_call(f->second, xs));
+    }
+    if (AOT) {
+      return bind(b, Ctxt.new_call(import(Name(P.Defs[callee]), Long, xs.size()),
+                                   xs));
+    }
+    auto &slot = Slots[callee];
+    auto args = Ctxt.zero(Long.get_pointer());
+    if (!xs.empty()) {
+      auto array = Fn.new_local(
+          Ctxt.new_array_type(Long, static_cast<int>(xs.size())), temp());
+      for (size_t i = 0; i < xs.size(); i++) {
+        b.add_assignment(Ctxt.new_array_access(
+                             array, Ctxt.new_rvalue(Long, static_cast<long>(i))),
+                         xs[i]);
+      }
+      args = Ctxt.new_array_access(array, Ctxt.zero(Long)).get_address();
+    }
+    auto code = ptr(EntryType.get_pointer(), &slot.Code).dereference();
+    return bind(b, callPtr(code, {ptr(VoidPtr, &slot), args}));
+  }
+
+  gccjit::rvalue expr(const parsing::Expr &e, gccjit::block &b) {
+    using parsing::ExprKind;
+    switch (e.Kind) {
+    case ExprKind::Num:
+      return Ctxt.new_rvalue(Long, static_cast<long>(e.Num));
+    case ExprKind::Unit:
+    case ExprKind::False:
+      return Ctxt.zero(Long);
+    case ExprKind::True:
+      return Ctxt.one(Long);
+    case ExprKind::Resolved:
+      return Locals.at(e.ID);
+    case ExprKind::Ite: {
+      auto cond = expr(e.Subs[0], b);
+      auto result = Fn.new_local(Long, temp());
+      auto [then, otherwise] = branch(e, cond, b);
+      auto join = Fn.new_block(temp());
+      then.add_assignment(result, expr(e.Subs[1], then));
+      then.end_with_jump(join);
+      otherwise.add_assignment(result, expr(e.Subs[2], otherwise));
+      otherwise.end_with_jump(join);
+      b = join;
+      return result;
+    }
+    case ExprKind::App: {
+      std::vector<gccjit::rvalue> xs{};
+      for (size_t i = 1; i < e.Subs.size(); i++) {
+        xs.push_back(bind(b, expr(e.Subs[i], b)));
+      }
+      count(b, e);
+      auto id = e.Subs[0].ID;
+      if (auto op = AsBuiltin(id)) {
+        return builtin(*op, xs, b);
+      }
+      auto callee = *P.Find(id);
+      if (auto ext = foreign(callee)) {
+        return external(*ext, xs, b);
+      }
+      return call(&e, callee, xs, b);
+    }
+    case ExprKind::Extern: {
+      std::vector<gccjit::rvalue> xs{};
+      for (const auto &sub : e.Subs) {
+        xs.push_back(bind(b, expr(sub, b)));
+      }
+      return external(e, xs, b);
+    }
+    case ExprKind::Lam:
+    case ExprKind::Cmd:
+    case ExprKind::Unresolved:
+      break;
+    }
+    unreachable();
+  }
+
+  // Lowers an expression in tail position. Self tail calls become jumps back
+  // to the loop header, other direct calls are required to be tail calls so
+  // that recursion runs in constant stack.
+  void ret(const parsing::Expr &e, gccjit::block &b) {
+    using parsing::ExprKind;
+    if (e.Kind == ExprKind::Ite) {
+      auto cond = expr(e.Subs[0], b);
+      auto [then, otherwise] = branch(e, cond, b);
+      ret(e.Subs[1], then);
+      ret(e.Subs[2], otherwise);
+      return;
+    }
+    if (e.Kind != ExprKind::App || AsBuiltin(e.Subs[0].ID)) {
+      b.end_with_return(expr(e, b));
+      return;
+    }
+
+    std::vector<gccjit::rvalue> xs{};
+    for (size_t i = 1; i < e.Subs.size(); i++) {
+      xs.push_back(bind(b, expr(e.Subs[i], b)));
+    }
+    count(b, e);
+    auto callee = *P.Find(e.Subs[0].ID);
+    if (auto ext = foreign(callee)) {
+      b.end_with_return(external(*ext, xs, b));
+      return;
+    }
+    if (callee == Current) {
+      if (Instrument) {
+        count(b, Profile->At(P.Defs[Current]).Taken);
+      }
+      auto &params = Params.at(Current);
+      for (size_t i = 0; i < xs.size(); i++) {
+        b.add_assignment(params[i], xs[i]);
+      }
+      b.end_with_jump(Loop);
+      return;
+    }
+
+    // Slot calls pass their arguments in a stack array, and more than six
+    // arguments spill to the stack, neither of which a sibling call allows.
+    if (!Fns.contains(callee)) {
+      copy(&e, callee);
+    }
+    auto f = Fns.find(callee);
+    if ((f == Fns.end() && !AOT) || xs.size() > 6) {
+      b.end_with_return(call(&e, callee, xs, b));
+      return;
+    }
+    auto fn = f != Fns.end()
+                  ? f->second
+                  : import(Name(P.Defs[callee]), Long, xs.size());
+    auto tail = Ctxt.new_call(fn, xs);
+    gcc_jit_rvalue_set_bool_require_tail_call(tail.get_inner_rvalue(), 1);
+    b.end_with_return(tail);
+  }
+
+  void define(size_t index, bool entered) {
+    const auto &d = P.Defs[index];
+    auto self = Fns.at(index);
+    Fn = self;
+    Current = index;
+    auto entry = Fn.new_block("entry");
+    count(entry, d);
+    Loop = Fn.new_block("loop");
+    entry.end_with_jump(Loop);
+    auto b = Loop;
+    ret(d.Ret, b);
+    if (!AOT && entered) {
+      enter(index);
+    }
+  }
+
+  // Defines the slot entry of a function, which unpacks the arguments.
+  void enter(size_t index) {
+    const auto &d = P.Defs[index];
+    auto self = Fns.at(index);
+    auto selfParam = Ctxt.new_param(VoidPtr, "self");
+    auto argsParam = Ctxt.new_param(Long.get_const().get_pointer(), "args");
+    std::vector<gccjit::param> entryParams{selfParam, argsParam};
+    Fn = Ctxt.new_function(GCC_JIT_FUNCTION_EXPORTED, Long, EntryName(d),
+                           entryParams, 0);
+    std::vector<gccjit::rvalue> args{};
+    for (size_t i = 0; i < d.Params.size(); i++) {
+      args.push_back(Ctxt.new_array_access(
+          argsParam, Ctxt.new_rvalue(Long, static_cast<long>(i))));
+    }
+    auto entry = Fn.new_block("entry");
+    entry.end_with_return(Ctxt.new_call(self, args));
+  }
+
+  gccjit::rvalue splat(gccjit::type vec, unsigned lanes, gccjit::rvalue x) {
+    return Ctxt.new_rvalue(vec, std::vector<gccjit::rvalue>(lanes, x));
+  }
+
+  // Lowers an expression to whole vectors if it only does wrapping arithmetic
+  // on numbers and the variables given.
+  std::optional<gccjit::rvalue>
+  lanewise(const parsing::Expr &e, gccjit::type vec, unsigned lanes,
+           const std::unordered_map<int, gccjit::rvalue> &vars) {
+    using parsing::ExprKind;
+    if (e.Kind == ExprKind::Num) {
+      return splat(vec, lanes, Ctxt.new_rvalue(Long, static_cast<long>(e.Num)));
+    }
+    if (e.Kind == ExprKind::Resolved) {
+      if (auto v = vars.find(e.ID); v != vars.end()) {
+        return v->second;
+      }
+      return {};
+    }
+    if (e.Kind != ExprKind::App || e.Subs.size() != 3) {
+      return {};
+    }
+    auto op = AsBuiltin(e.Subs[0].ID);
+    auto x = lanewise(e.Subs[1], vec, lanes, vars);
+    auto y = lanewise(e.Subs[2], vec, lanes, vars);
+    if (!op || !x || !y) {
+      return {};
+    }
+    if (*op == Builtin::Add) {
+      return Ctxt.new_plus(vec, *x, *y);
+    }
+    if (*op == Builtin::Sub) {
+      return Ctxt.new_minus(vec, *x, *y);
+    }
+    if (*op == Builtin::Mul) {
+      return Ctxt.new_mult(vec, *x, *y);
+    }
+    return {};
+  }
+
+  // Emits the vector loop of a kernel after b, leaving b as the block that
+  // continues to the scalar loop. Maps must be lanewise in the element, and
+  // reductions must add or multiply the accumulator by something lanewise.
+  // The lanes of a reduction fold into the accumulator when the loop ends,
+  // which gives the same result since -fwrapv makes arithmetic wrap.
+  void vectorize(Pattern pattern, const parsing::Def &d, size_t captures,
+                 unsigned lanes, gccjit::lvalue i, gccjit::block &b) {
+    using parsing::ExprKind;
+    if (pattern == Pattern::Filter) {
+      return;
+    }
+    auto in = Fn.get_param(0), out = Fn.get_param(1), n = Fn.get_param(2);
+    auto acc = Fn.get_param(3), caps = Fn.get_param(4);
+    auto vec = Long.get_vector(lanes);
+    // Arrays are only aligned to their numbers.
+    auto unaligned = vec.get_aligned(sizeof(int64_t)).get_pointer();
+    auto x = Fn.new_local(vec, "vx");
+    std::unordered_map<int, gccjit::rvalue> vars{{d.Params.back().ID, x}};
+    for (size_t k = 0; k < captures; k++) {
+      auto cap = Fn.new_local(vec, temp());
+      b.add_assignment(cap, splat(vec, lanes,
+                                  Ctxt.new_array_access(
+                                      caps, Ctxt.new_rvalue(
+                                                Long, static_cast<long>(k)))));
+      vars.emplace(d.Params[k].ID, cap);
+    }
+
+    std::optional<gccjit::rvalue> y{};
+    auto op = GCC_JIT_BINARY_OP_PLUS;
+    if (pattern == Pattern::Map) {
+      y = lanewise(d.Ret, vec, lanes, vars);
+    } else if (d.Ret.Kind == ExprKind::App && d.Ret.Subs.size() == 3) {
+      auto fold = AsBuiltin(d.Ret.Subs[0].ID);
+      auto self = d.Params[captures].ID;
+      const auto &l = d.Ret.Subs[1], &r = d.Ret.Subs[2];
+      auto isAcc = [&](const parsing::Expr &e) {
+        return e.Kind == ExprKind::Resolved && e.ID == self;
+      };
+      if (fold == Builtin::Add || fold == Builtin::Mul) {
+        op = fold == Builtin::Add ? GCC_JIT_BINARY_OP_PLUS
+                                  : GCC_JIT_BINARY_OP_MULT;
+        if (isAcc(l)) {
+          y = lanewise(r, vec, lanes, vars);
+        } else if (isAcc(r)) {
+          y = lanewise(l, vec, lanes, vars);
+        }
+      }
+    }
+    if (!y) {
+      return;
+    }
+
+    auto step = Ctxt.new_rvalue(Long, static_cast<long>(lanes));
+    auto sum = Fn.new_local(vec, "vacc");
+    b.add_assignment(sum, splat(vec, lanes,
+                                op == GCC_JIT_BINARY_OP_PLUS ? Ctxt.zero(Long)
+                                                             : Ctxt.one(Long)));
+    auto head = Fn.new_block("vhead");
+    auto body = Fn.new_block("vbody");
+    auto done = Fn.new_block("vdone");
+    b.end_with_jump(head);
+    head.end_with_conditional(
+        Ctxt.new_le(Ctxt.new_plus(Long, i, step), n), body, done);
+    auto at = [&](gccjit::rvalue base, gccjit::rvalue index) {
+      return Ctxt.new_cast(Ctxt.new_array_access(base, index).get_address(),
+                           unaligned)
+          .dereference();
+    };
+    body.add_assignment(x, at(in, i));
+    if (pattern == Pattern::Map) {
+      body.add_assignment(at(out, i), *y);
+    } else {
+      body.add_assignment_op(sum, op, *y);
+    }
+    body.add_assignment_op(i, GCC_JIT_BINARY_OP_PLUS, step);
+    body.end_with_jump(head);
+
+    if (pattern == Pattern::Reduce) {
+      auto spill = Fn.new_local(
+          Ctxt.new_array_type(Long, static_cast<int>(lanes)), "spill");
+      done.add_assignment(at(spill, Ctxt.zero(Long)), sum);
+      for (unsigned k = 0; k < lanes; k++) {
+        done.add_assignment_op(
+            acc, op,
+            Ctxt.new_array_access(spill,
+                                  Ctxt.new_rvalue(Long, static_cast<long>(k))));
+      }
+    }
+    b = done;
+  }
+
+public:
+  Codegen(gccjit::context &ctxt, const parsing::Program &p, Slot *slots)
+      : Ctxt{ctxt}, P{p}, Slots{slots}, AOT{slots == nullptr},
+        Long{ctxt.get_type(GCC_JIT_TYPE_LONG)},
+        VoidPtr{ctxt.get_type(GCC_JIT_TYPE_VOID_PTR)} {
+    EntryType = fnPtr(Long, {VoidPtr, Long.get_const().get_pointer()});
+  }
+
+  // Ahead-of-time code generation, see Codegen::Runtime and Codegen::Main.
+  Codegen(gccjit::context &ctxt, const parsing::Program &p)
+      : Codegen{ctxt, p, nullptr} {}
+
+  static std::string Name(const parsing::Def &d) { return "yonto_" + d.Text; }
+
+  static std::string EntryName(const parsing::Def &d) {
+    return "yonto_entry_" + d.Text;
+  }
+
+  static std::string KernelName(Pattern pattern, const parsing::Def &d) {
+    static constexpr const char *Names[] = {"map", "reduce", "filter"};
+    return std::string{"yonto_"} + Names[static_cast<size_t>(pattern)] + "_" +
+           d.Text;
+  }
+
+  void Use(pgo::Profile *profile, bool instrument) {
+    Profile = profile;
+    Instrument = profile && instrument;
+  }
+
+  // Slot entries for functions defined ahead of time, so that an interpreter
+  // can run them natively too.
+  void Entries(const std::vector<size_t> &indices) {
+    for (auto index : indices) {
+      enter(index);
+    }
+  }
+
+  void Functions(const std::vector<size_t> &indices) {
+    for (auto index : indices) {
+      declare(index,
+              AOT ? GCC_JIT_FUNCTION_EXPORTED : GCC_JIT_FUNCTION_INTERNAL,
+              Name(P.Defs[index]));
+    }
+    for (auto index : indices) {
+      define(index, true);
+    }
+    while (!Pending.empty()) {
+      auto index = Pending.back();
+      Pending.pop_back();
+      define(index, false);
+    }
+  }
+
+  // Defines the loop of a parallel builtin around a function defined in this
+  // context, so that GCC can inline the call. Functions doing only wrapping
+  // arithmetic on the element are lowered to vectors of the given lanes too,
+  // with the scalar loop running the tail.
+  void DefineKernel(Pattern pattern, size_t index, size_t captures,
+                    unsigned lanes) {
+    const auto &d = P.Defs[index];
+    auto numbers = Long.get_const().get_pointer();
+    auto in = Ctxt.new_param(numbers, "in");
+    auto out = Ctxt.new_param(Long.get_pointer(), "out");
+    auto n = Ctxt.new_param(Long, "n");
+    auto acc = Ctxt.new_param(Long, "acc");
+    auto caps = Ctxt.new_param(numbers, "captures");
+    std::vector<gccjit::param> params{in, out, n, acc, caps};
+    Fn = Ctxt.new_function(GCC_JIT_FUNCTION_EXPORTED, Long,
+                           KernelName(pattern, d), params, 0);
+    auto i = Fn.new_local(Long, "i");
+    auto kept = Fn.new_local(Long, "kept");
+    auto entry = Fn.new_block("entry");
+    auto head = Fn.new_block("head");
+    auto body = Fn.new_block("body");
+    auto done = Fn.new_block("done");
+    entry.add_assignment(i, Ctxt.zero(Long));
+    entry.add_assignment(kept, Ctxt.zero(Long));
+    if (lanes > 1) {
+      vectorize(pattern, d, captures, lanes, i, entry);
+    }
+    entry.end_with_jump(head);
+    head.end_with_conditional(Ctxt.new_lt(i, n), body, done);
+
+    std::vector<gccjit::rvalue> xs{};
+    for (size_t k = 0; k < captures; k++) {
+      xs.push_back(Ctxt.new_array_access(
+          caps, Ctxt.new_rvalue(Long, static_cast<long>(k))));
+    }
+    if (pattern == Pattern::Reduce) {
+      xs.push_back(acc);
+    }
+    auto x = Ctxt.new_array_access(in, i);
+    xs.push_back(x);
+    auto y = Ctxt.new_call(Fns.at(index), xs);
+    auto next = body;
+    switch (pattern) {
+    case Pattern::Map:
+      body.add_assignment(Ctxt.new_array_access(out, i), y);
+      break;
+    case Pattern::Reduce:
+      body.add_assignment(acc, y);
+      break;
+    case Pattern::Filter: {
+      auto keep = Fn.new_block("keep");
+      next = Fn.new_block("next");
+      body.end_with_conditional(Ctxt.new_ne(y, Ctxt.zero(Long)), keep, next);
+      keep.add_assignment(Ctxt.new_array_access(out, kept), x);
+      keep.add_assignment_op(kept, GCC_JIT_BINARY_OP_PLUS, Ctxt.one(Long));
+      keep.end_with_jump(next);
+      break;
+    }
+    }
+    next.add_assignment_op(i, GCC_JIT_BINARY_OP_PLUS, Ctxt.one(Long));
+    next.end_with_jump(head);
+    done.end_with_return(pattern == Pattern::Map      ? gccjit::rvalue{n}
+                         : pattern == Pattern::Reduce ? gccjit::rvalue{acc}
+                                                      : gccjit::rvalue{kept});
+  }
+
+  // Defines the runtime helpers once per ahead-of-time build. Executables
+  // print and exit on division by zero, code compiled for a host in this
+  // process raises a fault instead.
+  void Runtime(bool hosted) {
+    auto intType = Ctxt.get_type(GCC_JIT_TYPE_INT);
+    auto voidType = Ctxt.get_type(GCC_JIT_TYPE_VOID);
+
+    auto format = Ctxt.new_param(Ctxt.get_type(GCC_JIT_TYPE_CONST_CHAR_PTR),
+                                 "format");
+    std::vector<gccjit::param> printfParams{format};
+    auto printfFn = Ctxt.new_function(GCC_JIT_FUNCTION_IMPORTED, intType,
+                                      "printf", printfParams, 1);
+    auto status = Ctxt.new_param(intType, "status");
+    std::vector<gccjit::param> exitParams{status};
+    auto exitFn = Ctxt.new_function(GCC_JIT_FUNCTION_IMPORTED, voidType, "exit",
+                                    exitParams, 0);
+
+    auto n = Ctxt.new_param(Long, "n");
+    std::vector<gccjit::param> printParams{n};
+    auto printNum = Ctxt.new_function(GCC_JIT_FUNCTION_EXPORTED, Long,
+                                      "yonto_print", printParams, 0);
+    auto b = printNum.new_block("entry");
+    b.add_eval(Ctxt.new_call(printfFn, Ctxt.new_rvalue("%ld\n"), n));
+    b.end_with_return(Ctxt.zero(Long));
+
+    std::vector<gccjit::param> none{};
+    auto divide = Ctxt.new_function(GCC_JIT_FUNCTION_EXPORTED, voidType,
+                                    "yonto_divide_by_zero", none, 0);
+    b = divide.new_block("entry");
+    if (hosted) {
+      b.add_eval(callPtr(ptr(fnPtr(voidType, {}),
+                             reinterpret_cast<void *>(divideByZero)),
+                         {}));
+      b.end_with_return();
+      return;
+    }
+    b.add_eval(Ctxt.new_call(printfFn,
+                             Ctxt.new_rvalue("panic: division by zero\n")));
+    b.add_eval(Ctxt.new_call(exitFn, Ctxt.one(intType)));
+    b.end_with_return();
+  }
+
+  // Defines the C entry point of an executable.
+  void Main(size_t index) {
+    std::vector<gccjit::param> none{};
+    Fn = Ctxt.new_function(GCC_JIT_FUNCTION_EXPORTED,
+                           Ctxt.get_type(GCC_JIT_TYPE_INT), "main", none, 0);
+    auto b = Fn.new_block("entry");
+    std::vector<gccjit::rvalue> xs{};
+    b.add_eval(call(nullptr, index, xs, b));
+    b.end_with_return(Ctxt.zero(Ctxt.get_type(GCC_JIT_TYPE_INT)));
+  }
+};
+
+// Compiles functions into native code and swaps the entries into their slots
+// once ready. Hot functions are compiled on a background thread, one gccjit
+// context per function.
+class Compiler {
+  const parsing::Program &P;
+  Slot *Slots;
+  const Options &Opts;
+
+  std::mutex Mu{};
+  std::condition_variable Cv{};
+  std::deque<size_t> Queue{};
+  bool Stop{};
+  std::thread Worker{};
+  std::vector<gcc_jit_result *> Results{};
+
+  void loop() {
+    while (true) {
+      size_t index;
+      {
+        std::unique_lock lock{Mu};
+        Cv.wait(lock, [this] { return Stop || !Queue.empty(); });
+        if (Stop) {
+          return;
+        }
+        index = Queue.front();
+        Queue.pop_front();
+      }
+      Compile({index}, "tier-up");
+    }
+  }
+
+public:
+  Compiler(const parsing::Program &p, Slot *slots, const Options &opts)
+      : P{p}, Slots{slots}, Opts{opts} {}
+
+  Compiler(const Compiler &) = delete;
+  Compiler &operator=(const Compiler &) = delete;
+
+  ~Compiler() {
+    {
+      std::lock_guard lock{Mu};
+      Stop = true;
+    }
+    Cv.notify_all();
+    if (Worker.joinable()) {
+      Worker.join();
+    }
+    for (auto result : Results) {
+      gcc_jit_result_release(result);
+    }
+  }
+
+  // Compiles the functions into one context. The first one is the reason for
+  // the compilation, the rest are callees compiled along with it.
+  bool Compile(const std::vector<size_t> &indices, const char *reason) {
+    auto &slot = Slots[indices[0]];
+    auto start = std::chrono::steady_clock::now();
+
+    auto ctxt = gccjit::context::acquire();
+    Opts.Code.Configure(ctxt, slot.Def->Level);
+    Codegen codegen{ctxt, P, Slots};
+    codegen.Use(Opts.Profile, Opts.Instrument);
+    codegen.Functions(indices);
+    Opts.Code.Write(ctxt, slot.Def->Text);
+    auto result = ctxt.compile();
+    std::vector<Entry> codes{};
+    if (result) {
+      for (auto index : indices) {
+        codes.push_back(reinterpret_cast<Entry>(gcc_jit_result_get_code(
+            result, Codegen::EntryName(*Slots[index].Def).c_str())));
+      }
+      std::lock_guard lock{Mu};
+      Results.push_back(result);
+    }
+    ctxt.release();
+
+    if (!result) {
+      for (auto index : indices) {
+        Slots[index].State.store(Tier::Failed, std::memory_order_relaxed);
+      }
+      if (Opts.Trace) {
+        fprintf(stderr, "%s: %s failed\n", reason, slot.Def->Text.c_str());
+      }
+      return false;
+    }
+    for (size_t i = 0; i < indices.size(); i++) {
+      auto &compiled = Slots[indices[i]];
+      compiled.Code.store(codes[i], std::memory_order_release);
+      compiled.State.store(Tier::Native, std::memory_order_relaxed);
+    }
+    if (Opts.Trace) {
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      std::string names = slot.Def->Text;
+      for (size_t i = 1; i < indices.size(); i++) {
+        names += i == 1 ? " (+" : ", ";
+        names += Slots[indices[i]].Def->Text;
+      }
+      if (indices.size() > 1) {
+        names += ")";
+      }
+      fprintf(stderr, "%s: %s (calls=%u, loops=%u) compiled in %.1fms\n",
+              reason, names.c_str(), slot.Calls.load(), slot.Loops.load(),
+              elapsed.count());
+    }
+    return true;
+  }
+
+  // Compiles the loop of a parallel builtin along with its function, whose
+  // callees must be native already.
+  Kernel CompileKernel(Pattern pattern, size_t index, size_t captures) {
+    const auto &d = *Slots[index].Def;
+    auto name = Codegen::KernelName(pattern, d);
+    auto ctxt = gccjit::context::acquire();
+    Opts.Code.Configure(ctxt, d.Level);
+    Codegen codegen{ctxt, P, Slots};
+    codegen.Use(Opts.Profile, Opts.Instrument);
+    codegen.Functions({index});
+    codegen.DefineKernel(pattern, index, captures,
+                         Opts.Vectorize ? Lanes(ctxt) : 1);
+    Opts.Code.Write(ctxt, name);
+    auto result = ctxt.compile();
+    ctxt.release();
+    if (!result) {
+      if (Opts.Trace) {
+        fprintf(stderr, "kernel: %s failed\n", name.c_str());
+      }
+      return nullptr;
+    }
+    auto kernel =
+        reinterpret_cast<Kernel>(gcc_jit_result_get_code(result, name.c_str()));
+    std::lock_guard lock{Mu};
+    Results.push_back(result);
+    return kernel;
+  }
+
+  // The worker is started on the first request, so scripts that never get
+  // hot never pay for GCC.
+  void Enqueue(size_t index) {
+    {
+      std::lock_guard lock{Mu};
+      if (!Worker.joinable()) {
+        Worker = std::thread{[this] { loop(); }};
+      }
+      Queue.push_back(index);
+    }
+    Cv.notify_one();
+  }
+};
+
+} // namespace jit
+
+namespace aot {
+
+struct Options {
+  unsigned Jobs{1};
+  bool Shared{};
+  bool Verbose{};
+  std::string Output{};
+  pgo::Profile *Profile{};
+  jit::Target Code{};
+  std::vector<const char *> Libraries{};
+};
+
+// Splits the compilable functions into at most n shards of similar size.
+// Functions are laid out in breadth-first order over the undirected call graph
+// before cutting, so callers mostly end up in the same shard as their callees.
+static inline std::vector<std::vector<size_t>>
+Partition(const parsing::Program &p, const std::vector<bool> &eligible,
+          size_t n) {
+  std::vector<std::vector<size_t>> edges(p.Defs.size());
+  size_t total = 0;
+  for (size_t i = 0; i < p.Defs.size(); i++) {
+    if (!eligible[i]) {
+      continue;
+    }
+    total += opt::Size(p.Defs[i].Ret);
+    std::vector<size_t> callees{};
+    jit::Callees(p, p.Defs[i].Ret, callees);
+    for (auto callee : callees) {
+      edges[i].push_back(callee);
+      edges[callee].push_back(i);
+    }
+  }
+
+  std::vector<size_t> order{};
+  std::vector<bool> visited(p.Defs.size());
+  for (size_t root = 0; root < p.Defs.size(); root++) {
+    if (!eligible[root] || visited[root]) {
+      continue;
+    }
+    visited[root] = true;
+    order.push_back(root);
+    for (auto i = order.size() - 1; i < order.size(); i++) {
+      for (auto next : edges[order[i]]) {
+        if (!visited[next]) {
+          visited[next] = true;
+          order.push_back(next);
+        }
+      }
+    }
+  }
+
+  std::vector<std::vector<size_t>> shards(1);
+  auto budget = (total + n - 1) / std::max<size_t>(n, 1);
+  size_t size = 0;
+  for (auto i : order) {
+    if (size >= budget && shards.size() < n) {
+      shards.emplace_back();
+      size = 0;
+    }
+    shards.back().push_back(i);
+    size += opt::Size(p.Defs[i].Ret);
+  }
+  return shards;
+}
+
+static inline bool spawn(const std::vector<std::string> &args) {
+  std::vector<char *> argv{};
+  for (const auto &a : args) {
+    argv.push_back(const_cast<char *>(a.c_str()));
+  }
+  argv.push_back(nullptr);
+  auto pid = fork();
+  if (pid < 0) {
+    perror("fork error");
+    return false;
+  }
+  if (pid == 0) {
+    execvp(argv[0], argv.data());
+    perror("exec error");
+    _exit(127);
+  }
+  int status = 0;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+// Compiles every shard to an object file in its own worker process, since
+// libgccjit serializes compilation within a process, then links the objects.
+// Splits shards so that functions annotated with a different optimization
+// level end up in contexts of their own.
+static inline std::vector<std::vector<size_t>>
+ByLevel(const parsing::Program &p,
+        const std::vector<std::vector<size_t>> &shards) {
+  std::vector<std::vector<size_t>> split{};
+  for (const auto &shard : shards) {
+    std::map<std::optional<unsigned>, std::vector<size_t>> levels{};
+    for (auto index : shard) {
+      levels[p.Defs[index].Level].push_back(index);
+    }
+    if (levels.empty()) {
+      split.push_back(shard);
+    }
+    for (auto &[level, indices] : levels) {
+      split.push_back(std::move(indices));
+    }
+  }
+  return split;
+}
+
+class Builder {
+  const parsing::Program &P;
+  const Options &Opts;
+  std::vector<bool> Eligible;
+
+  bool compile(const std::vector<size_t> &shard, bool first,
+               std::optional<size_t> entry, const std::string &object) {
+    auto ctxt = gccjit::context::acquire();
+    Opts.Code.Configure(ctxt, shard.empty() ? std::nullopt
+                                            : P.Defs[shard[0]].Level);
+    ctxt.add_command_line_option("-fPIC");
+    jit::Codegen codegen{ctxt, P};
+    codegen.Use(Opts.Profile, false);
+    codegen.Functions(shard);
+    if (first) {
+      codegen.Runtime(false);
+      if (entry) {
+        codegen.Main(*entry);
+      }
+    }
+    auto stem = object.substr(object.rfind('/') + 1);
+    Opts.Code.Write(ctxt, stem.substr(0, stem.rfind('.')));
+    ctxt.compile_to_file(GCC_JIT_OUTPUT_KIND_OBJECT_FILE, object.c_str());
+    auto err = gcc_jit_context_get_first_error(ctxt.get_inner_context());
+    if (err) {
+      fprintf(stderr, "%s: %s\n", object.c_str(), err);
+    }
+    ctxt.release();
+    return !err;
+  }
+
+public:
+  Builder(const parsing::Program &p, const Options &opts)
+      : P{p}, Opts{opts}, Eligible{jit::Eligible(p, true)} {}
+
+  Result<std::string> Build() {
+    std::optional<size_t> entry{};
+    if (!Opts.Shared) {
+      for (size_t i = 0; i < P.Defs.size(); i++) {
+        if (P.Defs[i].Text == "main") {
+          entry = i;
+        }
+      }
+      if (!entry || !Eligible[*entry] || !P.Defs[*entry].Params.empty()) {
+        return Error{"main cannot be compiled ahead of time"};
+      }
+    }
+    for (size_t i = 0; i < P.Defs.size(); i++) {
+      if (!Eligible[i] && Opts.Verbose) {
+        fprintf(stderr, "build: skipping %s\n", P.Defs[i].Text.c_str());
+      }
+    }
+
+    auto tmp = getenv("TMPDIR");
+    auto dir = std::string{tmp && *tmp ? tmp : "/tmp"} + "/yonto-build-XXXXXX";
+    if (!mkdtemp(dir.data())) {
+      return Error{"create build directory error"};
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto shards = ByLevel(P, Partition(P, Eligible, Opts.Jobs));
+    std::vector<std::string> objects{};
+    // Splitting by level can give more shards than jobs, so at most Jobs
+    // workers run at once, the oldest awaited first.
+    std::deque<pid_t> workers{};
+    auto ok = true;
+    auto await = [&] {
+      auto pid = workers.front();
+      workers.pop_front();
+      int status = 0;
+      ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0 && ok;
+    };
+    for (size_t i = 0; i < shards.size(); i++) {
+      objects.push_back(dir + "/" + std::to_string(i) + ".o");
+      if (workers.size() >= std::max(Opts.Jobs, 1U)) {
+        await();
+      }
+      fflush(nullptr);
+      auto pid = fork();
+      if (pid == 0) {
+        _exit(compile(shards[i], i == 0, entry, objects[i]) ? 0 : 1);
+      }
+      if (pid < 0) {
+        perror("fork error");
+        ok = false;
+        break;
+      }
+      workers.push_back(pid);
+    }
+    while (!workers.empty()) {
+      await();
+    }
+
+    if (ok) {
+      auto cc = getenv("CC");
+      std::vector<std::string> args{cc ? cc : "cc"};
+      if (Opts.Shared) {
+        args.emplace_back("-shared");
+      }
+      args.insert(args.end(), objects.begin(), objects.end());
+      for (auto lib : Opts.Libraries) {
+        args.push_back(std::string{"-l"} + lib);
+      }
+      args.emplace_back("-o");
+      args.push_back(Opts.Output);
+      ok = spawn(args);
+    }
+    for (const auto &o : objects) {
+      unlink(o.c_str());
+    }
+    rmdir(dir.c_str());
+    if (!ok) {
+      return Error{"build error"};
+    }
+
+    if (Opts.Verbose) {
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - start;
+      fprintf(stderr, "build: %s from %zu shards in %.1fms\n",
+              Opts.Output.c_str(), shards.size(), elapsed.count());
+    }
+    return Opts.Output;
+  }
+};
+
+// Compiles every function that can be compiled ahead of time into memory,
+// for hosts that call them directly. The functions keep the calling convention
+// of ahead-of-time code, so calls go through no slot, lock or boxing. Their
+// slot entries are exported too, and since nothing in the code refers to a
+// slot, interpreters of the same program can share it. What the compiler
+// reported is left in diagnostic.
+static inline Result<gcc_jit_result *> InMemory(const parsing::Program &p,
+                                                const Options &opts,
+                                                std::string &diagnostic) {
+  auto eligible = jit::Eligible(p, true);
+  std::vector<size_t> indices{};
+  for (size_t i = 0; i < p.Defs.size(); i++) {
+    if (eligible[i]) {
+      indices.push_back(i);
+    }
+  }
+  auto ctxt = gccjit::context::acquire();
+  opts.Code.Configure(ctxt, std::nullopt);
+  jit::Codegen codegen{ctxt, p};
+  codegen.Use(opts.Profile, false);
+  codegen.Functions(indices);
+  codegen.Entries(indices);
+  codegen.Runtime(true);
+  opts.Code.Write(ctxt, "host");
+  auto result = ctxt.compile();
+  if (auto err = gcc_jit_context_get_first_error(ctxt.get_inner_context())) {
+    diagnostic = err;
+  }
+  ctxt.release();
+  if (!result) {
+    return Error{"compile error"};
+  }
+  return result;
+}
+
+} // namespace aot
+
+namespace gc {
+
+// Thrown by allocation when the heap is over its limit even after a full
+// collection, and turned into an error where the interpreter is entered.
+struct OutOfMemory {};
+
+enum class ObjectKind : uint8_t { Frame = 1, Closure, Box, Array };
+
+// Every heap object starts with this header. Size is in bytes and includes the
+// header.
+struct Object {
+  uint32_t Size{};
+  ObjectKind Kind{};
+  uint8_t Flags{};
+
+  static constexpr uint8_t Forwarded = 1;
+  static constexpr uint8_t Remembered = 2;
+};
+
+// Values are one word. Numbers that fit in 63 bits are immediates, shifted
+// left with the low bit set, so unit, booleans and almost every number never
+// touch the heap. Anything else is a pointer to a heap object, larger numbers
+// included, and pointers always have the low bit clear.
+class Value {
+  uint64_t Bits{1};
+
+  explicit constexpr Value(uint64_t bits) : Bits{bits} {}
+
+public:
+  static constexpr int64_t MinImmediate = INT64_MIN >> 1;
+  static constexpr int64_t MaxImmediate = INT64_MAX >> 1;
+
+  constexpr Value() = default;
+
+  static constexpr bool Fits(int64_t n) {
+    return n >= MinImmediate && n <= MaxImmediate;
+  }
+
+  static constexpr Value Immediate(int64_t n) {
+    return Value{(static_cast<uint64_t>(n) << 1) | 1};
+  }
+
+  static Value Of(Object *o) { return Value{reinterpret_cast<uint64_t>(o)}; }
+
+  [[nodiscard]] constexpr bool IsImmediate() const { return Bits & 1; }
+
+  [[nodiscard]] constexpr int64_t AsImmediate() const {
+    return static_cast<int64_t>(Bits) >> 1;
+  }
+
+  [[nodiscard]] Object *Ref() const {
+    return IsImmediate() ? nullptr : reinterpret_cast<Object *>(Bits);
+  }
+
+  // Only zero is false, which is also what unit and false evaluate to.
+  [[nodiscard]] constexpr bool Truthy() const { return Bits != 1; }
+};
+
+// A number that does not fit in an immediate.
+struct Box : Object {
+  int64_t Num{};
+};
+
+struct Var {
+  int ID{};
+  Value Val{};
+};
+
+// Numbers stored unboxed, Len of them after the header, so that native loops
+// can run over them in place.
+struct Array : Object {
+  int64_t Len{};
+
+  int64_t *Items() { return reinterpret_cast<int64_t *>(this + 1); }
+};
+
+// Variables bound by a call or captured by a lambda, followed by Count vars.
+struct Frame : Object {
+  Object *Up{};
+  uint32_t Count{};
+
+  Var *Vars() { return reinterpret_cast<Var *>(this + 1); }
+};
+
+// Lambdas carry their body and captured variables, references to top-level
+// functions and builtins only carry the resolved ID.
+struct Closure : Object {
+  const parsing::Expr *Lam{};
+  Object *Env{};
+  int ID{};
+};
+
+// A stack of values that grows by whole segments, so pushing never moves the
+// values already on it. Deep recursion costs a new segment rather than a copy
+// of the whole stack, and spare segments are kept for the next descent.
+class RootStack {
+  static constexpr size_t SegmentSize = 4096;
+  std::vector<std::unique_ptr<Value[]>> Segments{};
+  size_t Top{};
+
+public:
+  [[nodiscard]] size_t Size() const { return Top; }
+
+  Value &operator[](size_t i) {
+    return Segments[i / SegmentSize][i % SegmentSize];
+  }
+
+  const Value &operator[](size_t i) const {
+    return Segments[i / SegmentSize][i % SegmentSize];
+  }
+
+  void Push(const Value &v) {
+    if (Top == Segments.size() * SegmentSize) {
+      Segments.emplace_back(new Value[SegmentSize]);
+    }
+    (*this)[Top++] = v;
+  }
+
+  void Pop() {
+    if (Top == 0) {
+      panic("root stack underflow");
+    }
+    Top--;
+  }
+
+  void Truncate(size_t size) {
+    if (size > Top) {
+      panic("root stack overflow");
+    }
+    Top = size;
+    while (Segments.size() > Top / SegmentSize + 2) {
+      Segments.pop_back();
+    }
+  }
+
+  template <typename F> void ForEach(F &&visit) {
+    for (size_t i = 0; i < Top; i += SegmentSize) {
+      auto segment = Segments[i / SegmentSize].get();
+      auto n = std::min(SegmentSize, Top - i);
+      for (size_t j = 0; j < n; j++) {
+        visit(segment[j]);
+      }
+    }
+  }
+};
+
+// Gray objects, for the markers to steal from each other.
+using MarkDeque = mem::Deque<Object *>;
+
+struct Options {
+  size_t Nursery{1 << 20};
+  // Longest pause the collector aims for, zero for unbounded. Minor
+  // collections always run to completion, what is left of the budget goes to
+  // marking or sweeping the old space.
+  std::chrono::microseconds MaxPause{1000};
+  // Hard limit on the bytes mapped by the heap, zero for none.
+  size_t MaxBytes{};
+  // Threads marking the old space, the mutator included.
+  unsigned Markers{std::clamp(std::thread::hardware_concurrency(), 1U, 8U)};
+  bool Stats{};
+};
+
+struct Stats {
+  uint64_t Allocated{}, Promoted{}, Minor{}, Major{}, Pauses{}, Marked{};
+  // Old space allocations by size class, and those that needed a new page.
+  uint64_t Cells[14]{}, NewPages[14]{};
+  std::chrono::nanoseconds Paused{}, MaxPause{}, Marking{};
+  // Pause counts by power of two microseconds, the first bucket is below 1us.
+  uint64_t Histogram[24]{};
+};
+
+// A generational heap. New objects are bump-allocated in a nursery owned by
+// the mutator thread, and minor collections copy the survivors into the old
+// space. The old space is made of pages of equally sized cells, one page per
+// size class, with live and mark bitmaps on the side. It is collected by
+// incremental mark-sweep in slices that follow minor collections.
+//
+// Marking is snapshot-at-the-beginning: it starts right after a minor
+// collection, when every object is old, from the roots of that moment. The
+// write barrier shades the references it overwrites, and objects promoted or
+// allocated old while marking are black. Pages are swept lazily, either by
+// the slices or when allocation runs out of cells of their size.
+//
+// Slices with enough gray objects are marked in parallel. Every marker owns a
+// work-stealing deque, sets mark bits atomically and prefetches the objects
+// it pushes. Markers stop at the deadline of the slice, and the gray objects
+// left in their deques carry over to the next slice.
+//
+// Old objects that point into the nursery are kept in the remembered set by
+// the write barrier.
+class Heap {
+  static constexpr size_t PageSize = mem::PagePool::PageSize;
+  static constexpr size_t MinCell = 32;
+  static constexpr size_t Words = PageSize / MinCell / 64;
+  static constexpr size_t Classes[] = {32,  48,  64,  96,  128,  192, 256,
+                                       384, 512, 768, 1024, 1536, 2048};
+  static constexpr size_t Large = std::size(Classes);
+  static_assert(Large < std::size(Stats{}.Cells));
+  static constexpr size_t MinMajor = 4 * 1024 * 1024;
+  // Objects marked or pages swept between checks of the clock.
+  static constexpr size_t SliceCheck = 256;
+  // The mutator marks alone until it has this many gray objects.
+  static constexpr size_t ParallelMark = 256;
+
+  struct Page {
+    size_t Bytes{};
+    size_t Class{};
+    size_t Cell{};
+    size_t Cells{};
+    char *Begin{};
+    uint64_t Live[Words]{};
+    uint64_t Marks[Words]{};
+  };
+
+  enum class Phase { Idle, Marking, Sweeping };
+
+  Options Opts;
+  std::unique_ptr<char[]> Nursery;
+  char *Top{}, *Limit{};
+  std::vector<Page *> Pages{};
+  void *Free[Large]{};
+  size_t OldBytes{}, NextMajor{MinMajor};
+  // Bytes taken from the page pool plus the nursery, checked against the
+  // limit.
+  size_t Mapped{};
+  bool Collecting{};
+  std::vector<Object *> Remembered{};
+  std::vector<Object *> Promoted{};
+  Phase State{Phase::Idle};
+  std::vector<Object *> Gray{};
+  std::vector<Page *> Unswept[Large + 1]{};
+  std::vector<Page *> Empty{};
+  std::vector<std::vector<Value> *> Roots{};
+  std::vector<RootStack *> Stacks{};
+  Stats Counters{};
+  std::chrono::steady_clock::time_point Start;
+
+  using Clock = std::chrono::steady_clock;
+
+  // Marker threads are started on the first parallel slice and wait for the
+  // next round in between.
+  std::vector<std::unique_ptr<MarkDeque>> Deques{};
+  std::vector<std::thread> Markers{};
+  std::mutex MarkMu{};
+  std::condition_variable MarkCv{}, DoneCv{};
+  uint64_t Round{};
+  size_t Running{};
+  bool Quit{};
+  std::atomic<size_t> Idle{};
+  std::atomic<bool> Stop{};
+  std::atomic<uint64_t> Marked{};
+  std::optional<Clock::time_point> Deadline{};
+
+  static Page *page(const Object *o) {
+    return reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(o) &
+                                    ~(PageSize - 1));
+  }
+
+  static size_t cell(const Page *p, const Object *o) {
+    return static_cast<size_t>(reinterpret_cast<const char *>(o) - p->Begin) /
+           p->Cell;
+  }
+
+  static size_t classOf(size_t size) {
+    for (size_t c = 0; c < Large; c++) {
+      if (size <= Classes[c]) {
+        return c;
+      }
+    }
+    return Large;
+  }
+
+  bool young(const Object *o) const {
+    auto p = reinterpret_cast<const char *>(o);
+    return p >= Nursery.get() && p < Limit;
+  }
+
+  // Over the limit, the heap is collected in full, unless a collection is
+  // running. That one checks again when it is done.
+  void reserve(size_t bytes) {
+    if (Opts.MaxBytes == 0 || Mapped + bytes <= Opts.MaxBytes || Collecting) {
+      return;
+    }
+    full();
+    if (Mapped + bytes > Opts.MaxBytes) {
+      throw OutOfMemory{};
+    }
+  }
+
+  Page *newPage(size_t c, size_t size) {
+    auto header = (sizeof(Page) + 15) & ~size_t{15};
+    auto bytes = (header + size + PageSize - 1) & ~(PageSize - 1);
+    reserve(bytes);
+    auto mem = mem::PagePool::Shared().Get(bytes);
+    if (!mem) {
+      throw OutOfMemory{};
+    }
+    Mapped += bytes;
+    auto p = new (mem) Page{};
+    p->Bytes = bytes;
+    p->Class = c;
+    p->Cell = c == Large ? size : Classes[c];
+    p->Cells = c == Large ? 1 : (PageSize - header) / p->Cell;
+    p->Begin = static_cast<char *>(mem) + header;
+    Pages.push_back(p);
+    return p;
+  }
+
+  void freeCells(Page *p) {
+    for (size_t i = p->Cells; i-- > 0;) {
+      if (!(p->Live[i / 64] & (uint64_t{1} << (i % 64)))) {
+        auto cell = p->Begin + i * p->Cell;
+        *reinterpret_cast<void **>(cell) = Free[p->Class];
+        Free[p->Class] = cell;
+      }
+    }
+  }
+
+  Object *old(size_t size) {
+    auto c = classOf(size);
+    Page *p{};
+    void *mem{};
+    if (c == Large) {
+      p = newPage(c, size);
+      Counters.NewPages[c]++;
+      mem = p->Begin;
+    } else {
+      while (!Free[c] && !Unswept[c].empty()) {
+        auto unswept = Unswept[c].back();
+        Unswept[c].pop_back();
+        sweep(unswept);
+      }
+      if (!Free[c]) {
+        freeCells(newPage(c, 0));
+        Counters.NewPages[c]++;
+      }
+      mem = Free[c];
+      Free[c] = *static_cast<void **>(mem);
+      p = page(static_cast<Object *>(mem));
+    }
+    auto o = static_cast<Object *>(mem);
+    auto i = cell(p, o);
+    Counters.Cells[c]++;
+    p->Live[i / 64] |= uint64_t{1} << (i % 64);
+    if (State == Phase::Marking) {
+      p->Marks[i / 64] |= uint64_t{1} << (i % 64);
+    }
+    OldBytes += p->Cell;
+    return o;
+  }
+
+  // Copies a nursery object into the old space, leaving a forwarding pointer
+  // behind in its first field.
+  Object *promote(Object *o) {
+    auto forward = reinterpret_cast<Object **>(o + 1);
+    if (o->Flags & Object::Forwarded) {
+      return *forward;
+    }
+    auto to = old(o->Size);
+    memcpy(static_cast<void *>(to), o, o->Size);
+    to->Flags = 0;
+    o->Flags |= Object::Forwarded;
+    *forward = to;
+    Promoted.push_back(to);
+    Counters.Promoted += o->Size;
+    return to;
+  }
+
+  template <typename F> static void trace(Object *o, F &&visit) {
+    switch (o->Kind) {
+    case ObjectKind::Frame: {
+      auto f = static_cast<Frame *>(o);
+      visit(f->Up);
+      for (uint32_t i = 0; i < f->Count; i++) {
+        Heap::visit(f->Vars()[i].Val, visit);
+      }
+      return;
+    }
+    case ObjectKind::Closure:
+      visit(static_cast<Closure *>(o)->Env);
+      return;
+    case ObjectKind::Box:
+    case ObjectKind::Array:
+      return;
+    }
+    unreachable();
+  }
+
+  template <typename F> static void visit(Value &v, F &&visit) {
+    if (auto o = v.Ref()) {
+      visit(o);
+      v = Value::Of(o);
+    }
+  }
+
+  template <typename F> void roots(F &&visit) {
+    for (auto values : Roots) {
+      for (auto &v : *values) {
+        Heap::visit(v, visit);
+      }
+    }
+    for (auto stack : Stacks) {
+      stack->ForEach([&](Value &v) { Heap::visit(v, visit); });
+    }
+  }
+
+  void minor() {
+    auto visit = [this](Object *&ref) {
+      if (ref && young(ref)) {
+        ref = promote(ref);
+      }
+    };
+    roots(visit);
+    for (auto o : Remembered) {
+      o->Flags &= static_cast<uint8_t>(~Object::Remembered);
+      trace(o, visit);
+    }
+    Remembered.clear();
+    while (!Promoted.empty()) {
+      auto o = Promoted.back();
+      Promoted.pop_back();
+      trace(o, visit);
+    }
+    Top = Nursery.get();
+    Counters.Minor++;
+  }
+
+  // Sets the mark bit, true if it was clear.
+  static bool mark(Object *o) {
+    auto p = page(o);
+    auto i = cell(p, o);
+    auto bit = uint64_t{1} << (i % 64);
+    std::atomic_ref word{p->Marks[i / 64]};
+    if (word.load(std::memory_order_relaxed) & bit) {
+      return false;
+    }
+    return !(word.fetch_or(bit, std::memory_order_relaxed) & bit);
+  }
+
+  void shade(Object *o) {
+    if (mark(o)) {
+      Gray.push_back(o);
+    }
+  }
+
+  Object *steal(size_t self) {
+    for (size_t k = 1; k < Deques.size(); k++) {
+      if (auto o = Deques[(self + k) % Deques.size()]->Steal()) {
+        return o;
+      }
+    }
+    return nullptr;
+  }
+
+  void drain(size_t self) {
+    auto &own = *Deques[self];
+    auto visit = [&](Object *&ref) {
+      if (ref && mark(ref)) {
+        __builtin_prefetch(ref);
+        own.Push(ref);
+      }
+    };
+    size_t work = 0;
+    uint64_t marked = 0;
+    while (!Stop.load(std::memory_order_relaxed)) {
+      auto o = own.Pop();
+      if (!o) {
+        o = steal(self);
+      }
+      if (o) {
+        trace(o, visit);
+        marked++;
+        if (expired(Deadline, work)) {
+          Stop.store(true, std::memory_order_relaxed);
+        }
+        continue;
+      }
+      // Every marker is done once all of them are idle, since only busy ones
+      // push work.
+      Idle.fetch_add(1);
+      while (true) {
+        if (Stop.load(std::memory_order_relaxed) ||
+            Idle.load() == Deques.size()) {
+          Marked.fetch_add(marked, std::memory_order_relaxed);
+          return;
+        }
+        auto busy = std::any_of(Deques.begin(), Deques.end(),
+                                [](const auto &d) { return !d->Empty(); });
+        if (busy) {
+          Idle.fetch_sub(1);
+          break;
+        }
+        std::this_thread::yield();
+      }
+    }
+    Marked.fetch_add(marked, std::memory_order_relaxed);
+  }
+
+  void marker(size_t self) {
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock lock{MarkMu};
+        MarkCv.wait(lock, [&] { return Quit || Round != seen; });
+        if (Quit) {
+          return;
+        }
+        seen = Round;
+      }
+      drain(self);
+      {
+        std::lock_guard lock{MarkMu};
+        Running--;
+      }
+      DoneCv.notify_one();
+    }
+  }
+
+  void markParallel() {
+    if (Markers.empty()) {
+      for (size_t i = 0; i < Opts.Markers; i++) {
+        Deques.push_back(std::make_unique<MarkDeque>());
+      }
+      for (size_t i = 1; i < Opts.Markers; i++) {
+        Markers.emplace_back([this, i] { marker(i); });
+      }
+    }
+    for (size_t i = 0; i < Gray.size(); i++) {
+      Deques[i % Deques.size()]->Push(Gray[i]);
+    }
+    Gray.clear();
+    Idle.store(0);
+    Stop.store(false);
+    Marked.store(0);
+    {
+      std::lock_guard lock{MarkMu};
+      Round++;
+      Running = Markers.size();
+    }
+    MarkCv.notify_all();
+    drain(0);
+    {
+      std::unique_lock lock{MarkMu};
+      DoneCv.wait(lock, [&] { return Running == 0; });
+    }
+    for (auto &d : Deques) {
+      while (auto o = d->Pop()) {
+        Gray.push_back(o);
+      }
+    }
+    Counters.Marked += Marked.load();
+  }
+
+  static bool expired(std::optional<Clock::time_point> deadline, size_t &work) {
+    return deadline && ++work % SliceCheck == 0 && Clock::now() >= *deadline;
+  }
+
+  void mark(std::optional<Clock::time_point> deadline) {
+    auto start = Clock::now();
+    auto visit = [this](Object *&ref) {
+      if (ref) {
+        shade(ref);
+      }
+    };
+    size_t work = 0;
+    while (!Gray.empty()) {
+      if (Opts.Markers > 1 && Gray.size() >= ParallelMark) {
+        Deadline = deadline;
+        markParallel();
+        break;
+      }
+      if (expired(deadline, work)) {
+        break;
+      }
+      auto o = Gray.back();
+      Gray.pop_back();
+      trace(o, visit);
+      Counters.Marked++;
+    }
+    Counters.Marking += Clock::now() - start;
+    if (!Gray.empty()) {
+      return;
+    }
+    State = Phase::Sweeping;
+    std::fill(std::begin(Free), std::end(Free), nullptr);
+    for (auto p : Pages) {
+      Unswept[p->Class].push_back(p);
+    }
+  }
+
+  // Dead objects still in the remembered set are kept until the next cycle,
+  // since the next minor collection scans them.
+  void sweep(Page *p) {
+    size_t before = 0, live = 0;
+    for (size_t w = 0; w < Words; w++) {
+      for (auto dead = p->Live[w] & ~p->Marks[w]; dead != 0;
+           dead &= dead - 1) {
+        auto i = w * 64 + static_cast<size_t>(__builtin_ctzll(dead));
+        auto o = reinterpret_cast<Object *>(p->Begin + i * p->Cell);
+        if (o->Flags & Object::Remembered) {
+          p->Marks[w] |= uint64_t{1} << (i % 64);
+        }
+      }
+      before += static_cast<size_t>(__builtin_popcountll(p->Live[w]));
+      p->Live[w] &= p->Marks[w];
+      p->Marks[w] = 0;
+      live += static_cast<size_t>(__builtin_popcountll(p->Live[w]));
+    }
+    OldBytes -= (before - live) * p->Cell;
+    if (live == 0) {
+      Empty.push_back(p);
+    } else if (p->Class != Large) {
+      freeCells(p);
+    }
+  }
+
+  void sweep(std::optional<Clock::time_point> deadline) {
+    size_t work = 0;
+    for (auto &pages : Unswept) {
+      while (!pages.empty()) {
+        if (expired(deadline, work)) {
+          return;
+        }
+        auto p = pages.back();
+        pages.pop_back();
+        sweep(p);
+      }
+    }
+    std::sort(Empty.begin(), Empty.end());
+    std::erase_if(Pages, [&](Page *p) {
+      return std::binary_search(Empty.begin(), Empty.end(), p);
+    });
+    for (auto p : Empty) {
+      Mapped -= p->Bytes;
+      mem::PagePool::Shared().Put(p, p->Bytes);
+    }
+    Empty.clear();
+    NextMajor = std::max(MinMajor, OldBytes * 2);
+    State = Phase::Idle;
+    Counters.Major++;
+  }
+
+  void pause(Clock::time_point start) {
+    auto elapsed = Clock::now() - start;
+    Counters.Pauses++;
+    Counters.Paused += elapsed;
+    Counters.MaxPause = std::max(Counters.MaxPause, elapsed);
+    auto us = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    size_t bucket = 0;
+    while (us > 0 && bucket + 1 < std::size(Counters.Histogram)) {
+      us >>= 1;
+      bucket++;
+    }
+    Counters.Histogram[bucket]++;
+  }
+
+  // Finishes the current cycle and runs another one from scratch, without a
+  // pause budget.
+  void full() {
+    auto start = Clock::now();
+    Collecting = true;
+    minor();
+    for (auto cycles = State == Phase::Idle ? 1 : 2; cycles > 0; cycles--) {
+      if (State == Phase::Idle) {
+        State = Phase::Marking;
+        roots([this](Object *&ref) {
+          if (ref) {
+            shade(ref);
+          }
+        });
+      }
+      while (State == Phase::Marking) {
+        mark(std::nullopt);
+      }
+      sweep(std::nullopt);
+    }
+    Collecting = false;
+    pause(start);
+  }
+
+  void barrier(Object *holder, Object *prev, const Object *value) {
+    if (State == Phase::Marking && prev && !young(prev)) {
+      shade(prev);
+    }
+    if (value && !young(holder) && young(value) &&
+        !(holder->Flags & Object::Remembered)) {
+      holder->Flags |= Object::Remembered;
+      Remembered.push_back(holder);
+    }
+  }
+
+public:
+  explicit Heap(const Options &opts)
+      : Opts{opts}, Nursery{new char[opts.Nursery]},
+        Top{Nursery.get()}, Limit{Nursery.get() + opts.Nursery},
+        Mapped{opts.Nursery}, Start{Clock::now()} {}
+
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+
+  ~Heap() {
+    {
+      std::lock_guard lock{MarkMu};
+      Quit = true;
+    }
+    MarkCv.notify_all();
+    for (auto &t : Markers) {
+      t.join();
+    }
+    for (auto p : Pages) {
+      mem::PagePool::Shared().Put(p, p->Bytes);
+    }
+  }
+
+  // Every value in the vector is a root, and is updated when its referent
+  // moves.
+  void Root(std::vector<Value> *values) { Roots.push_back(values); }
+  void Root(RootStack *stack) { Stacks.push_back(stack); }
+
+  void Collect() {
+    auto start = Clock::now();
+    std::optional<Clock::time_point> deadline{};
+    if (Opts.MaxPause.count() > 0) {
+      deadline = start + Opts.MaxPause;
+    }
+    Collecting = true;
+    minor();
+    if (State == Phase::Idle && OldBytes >= NextMajor) {
+      State = Phase::Marking;
+      roots([this](Object *&ref) {
+        if (ref) {
+          shade(ref);
+        }
+      });
+    }
+    if (State == Phase::Marking) {
+      mark(deadline);
+    }
+    if (State == Phase::Sweeping) {
+      sweep(deadline);
+    }
+    Collecting = false;
+    pause(start);
+    if (Opts.MaxBytes != 0 && Mapped > Opts.MaxBytes) {
+      full();
+      if (Mapped > Opts.MaxBytes) {
+        throw OutOfMemory{};
+      }
+    }
+  }
+
+  // Objects too big for the nursery are allocated old.
+  Object *Allocate(size_t size, ObjectKind kind) {
+    size = (size + 7) & ~size_t{7};
+    Counters.Allocated += size;
+    Object *o{};
+    if (size > Opts.Nursery / 8) {
+      o = old(size);
+    } else {
+      if (Top + size > Limit) {
+        Collect();
+      }
+      o = reinterpret_cast<Object *>(Top);
+      Top += size;
+    }
+    o->Size = static_cast<uint32_t>(size);
+    o->Kind = kind;
+    o->Flags = 0;
+    return o;
+  }
+
+  Frame *NewFrame(uint32_t count) {
+    auto o = Allocate(sizeof(Frame) + count * sizeof(Var), ObjectKind::Frame);
+    auto f = static_cast<Frame *>(o);
+    f->Up = nullptr;
+    f->Count = count;
+    for (uint32_t i = 0; i < count; i++) {
+      new (&f->Vars()[i]) Var{};
+    }
+    return f;
+  }
+
+  // Numbers are only boxed when they do not fit in an immediate.
+  Value Number(int64_t n) {
+    if (Value::Fits(n)) [[likely]] {
+      return Value::Immediate(n);
+    }
+    auto b = static_cast<Box *>(Allocate(sizeof(Box), ObjectKind::Box));
+    b->Num = n;
+    return Value::Of(b);
+  }
+
+  // Arrays are zeroed. Their size must fit in an object header.
+  Array *NewArray(int64_t n) {
+    auto bytes = sizeof(Array) + static_cast<uint64_t>(n) * sizeof(int64_t);
+    if (n < 0 || bytes > UINT32_MAX - 7) {
+      fail("bad array length");
+    }
+    auto a = static_cast<Array *>(Allocate(bytes, ObjectKind::Array));
+    a->Len = n;
+    memset(a->Items(), 0, static_cast<size_t>(n) * sizeof(int64_t));
+    return a;
+  }
+
+  static bool IsNumber(const Value &v) {
+    return v.IsImmediate() || v.Ref()->Kind == ObjectKind::Box;
+  }
+
+  // Functions used as numbers are zero.
+  static int64_t Num(const Value &v) {
+    if (v.IsImmediate()) [[likely]] {
+      return v.AsImmediate();
+    }
+    auto o = v.Ref();
+    return o->Kind == ObjectKind::Box ? static_cast<Box *>(o)->Num : 0;
+  }
+
+  Closure *NewClosure(const parsing::Expr *lam, int id) {
+    auto c = static_cast<Closure *>(
+        Allocate(sizeof(Closure), ObjectKind::Closure));
+    c->Lam = lam;
+    c->Env = nullptr;
+    c->ID = id;
+    return c;
+  }
+
+  // Stores a reference into a heap object.
+  void Write(Object *holder, Object *&field, Object *value) {
+    barrier(holder, field, value);
+    field = value;
+  }
+
+  void Write(Object *holder, Value &field, const Value &value) {
+    barrier(holder, field.Ref(), value.Ref());
+    field = value;
+  }
+
+  // Bytes mapped by the heap, which MaxBytes bounds.
+  [[nodiscard]] size_t Footprint() const { return Mapped; }
+
+  void Report() const {
+    std::chrono::duration<double> elapsed = Clock::now() - Start;
+    auto mib = [](uint64_t bytes) {
+      return static_cast<double>(bytes) / (1024 * 1024);
+    };
+    auto ms = [](std::chrono::nanoseconds ns) {
+      return std::chrono::duration<double, std::milli>(ns).count();
+    };
+    fprintf(stderr,
+            "gc: allocated %.1fMiB (%.1fMiB/s), promoted %.1fMiB, old %.1fMiB "
+            "in %zu pages\n",
+            mib(Counters.Allocated),
+            mib(Counters.Allocated) / std::max(elapsed.count(), 1e-9),
+            mib(Counters.Promoted), mib(OldBytes), Pages.size());
+    fprintf(stderr, "gc: marked %lu objects in %.3fms on %u threads\n",
+            Counters.Marked, ms(Counters.Marking), Opts.Markers);
+    fprintf(stderr,
+            "gc: %lu minor, %lu major, %lu pauses (%.3fms avg, %.3fms max)\n",
+            Counters.Minor, Counters.Major, Counters.Pauses,
+            Counters.Pauses == 0
+                ? 0.0
+                : ms(Counters.Paused) / static_cast<double>(Counters.Pauses),
+            ms(Counters.MaxPause));
+    std::string histogram{};
+    for (size_t i = 0; i < std::size(Counters.Histogram); i++) {
+      if (Counters.Histogram[i] == 0) {
+        continue;
+      }
+      histogram += " <" + std::to_string(uint64_t{1} << i) +
+                   "us: " + std::to_string(Counters.Histogram[i]);
+    }
+    fprintf(stderr, "gc: pauses%s\n", histogram.c_str());
+    size_t paged = 0;
+    for (auto p : Pages) {
+      paged += p->Bytes;
+    }
+    fprintf(stderr,
+            "gc: mapped %.1fMiB, fragmentation %.1f%%, pool %lu hits, %lu "
+            "misses\n",
+            mib(Mapped),
+            paged == 0 ? 0.0
+                       : 100.0 * (1.0 - static_cast<double>(OldBytes) /
+                                            static_cast<double>(paged)),
+            mem::PagePool::Shared().Hit(), mem::PagePool::Shared().Missed());
+    std::string classes{};
+    for (size_t c = 0; c <= Large; c++) {
+      if (Counters.Cells[c] == 0) {
+        continue;
+      }
+      classes += " " + (c == Large ? "large" : std::to_string(Classes[c])) +
+                 ": " + std::to_string(Counters.Cells[c]) + "/" +
+                 std::to_string(Counters.NewPages[c]);
+    }
+    fprintf(stderr, "gc: cells/pages by class%s\n", classes.c_str());
+  }
+};
+
+} // namespace gc
+
+namespace io {
+
+// An event loop over io_uring, or over epoll where io_uring is not
+// available. Operations are queued with a tag, submitted together by the
+// next Wait, and their completions are collected in batches.
+class Loop {
+public:
+  struct Completion {
+    uint64_t Tag{};
+    // What the operation returned, a negative errno on failure.
+    int Result{};
+  };
+
+private:
+  int Ring{-1}, Epoll{-1};
+  // io_uring: the submission and completion rings shared with the kernel.
+  void *SqMap{MAP_FAILED}, *CqMap{MAP_FAILED};
+  size_t SqSize{}, CqSize{}, SqesSize{};
+  io_uring_sqe *Sqes{};
+  io_uring_cqe *Cqes{};
+  unsigned *SqHead{}, *SqTail{}, *SqArray{}, *CqHead{}, *CqTail{};
+  unsigned SqMask{}, CqMask{}, SqEntries{};
+  unsigned Tail{}, Queued{};
+  size_t Inflight{};
+  // epoll: the descriptor of every operation, removed once it completes,
+  // and completions known before waiting.
+  std::unordered_map<uint64_t, int> Polled{};
+  std::vector<Completion> Ready{};
+
+  bool setup(unsigned entries) {
+    io_uring_params p{};
+    Ring = static_cast<int>(syscall(SYS_io_uring_setup, entries, &p));
+    if (Ring < 0) {
+      return false;
+    }
+    SqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    CqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    auto single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+      SqSize = CqSize = std::max(SqSize, CqSize);
+    }
+    auto map = [this](size_t size, off_t offset) {
+      return mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, Ring, offset);
+    };
+    SqMap = map(SqSize, IORING_OFF_SQ_RING);
+    CqMap = single ? SqMap : map(CqSize, IORING_OFF_CQ_RING);
+    SqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    auto sqes = map(SqesSize, IORING_OFF_SQES);
+    if (SqMap == MAP_FAILED || CqMap == MAP_FAILED || sqes == MAP_FAILED) {
+      if (sqes != MAP_FAILED) {
+        munmap(sqes, SqesSize);
+      }
+      teardown();
+      return false;
+    }
+    auto sq = static_cast<char *>(SqMap), cq = static_cast<char *>(CqMap);
+    Sqes = static_cast<io_uring_sqe *>(sqes);
+    SqHead = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    SqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    SqArray = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    SqMask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    SqEntries = p.sq_entries;
+    CqHead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    CqTail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    CqMask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    Cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    Tail = *SqTail;
+    return true;
+  }
+
+  void teardown() {
+    if (Sqes) {
+      munmap(Sqes, SqesSize);
+    }
+    if (CqMap != MAP_FAILED && CqMap != SqMap) {
+      munmap(CqMap, CqSize);
+    }
+    if (SqMap != MAP_FAILED) {
+      munmap(SqMap, SqSize);
+    }
+    close(Ring);
+    Ring = -1;
+  }
+
+  // Hands the queued submissions to the kernel, waiting for min completions.
+  void enter(unsigned min) {
+    std::atomic_ref{*SqTail}.store(Tail, std::memory_order_release);
+    auto flags = min > 0 ? IORING_ENTER_GETEVENTS : 0u;
+    while (Queued > 0 || min > 0) {
+      auto n = syscall(SYS_io_uring_enter, Ring, Queued, min, flags, nullptr,
+                       0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        panic("submit io error");
+      }
+      Queued -= static_cast<unsigned>(n);
+      break;
+    }
+  }
+
+  io_uring_sqe *next() {
+    if (Tail - std::atomic_ref{*SqHead}.load(std::memory_order_acquire) ==
+        SqEntries) {
+      enter(0);
+    }
+    auto index = Tail & SqMask;
+    auto sqe = &Sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    SqArray[index] = index;
+    Tail++;
+    Queued++;
+    Inflight++;
+    return sqe;
+  }
+
+  size_t reap(std::vector<Completion> &out) {
+    auto head = *CqHead;
+    auto tail = std::atomic_ref{*CqTail}.load(std::memory_order_acquire);
+    size_t n = 0;
+    for (; head != tail; head++, n++) {
+      const auto &cqe = Cqes[head & CqMask];
+      out.push_back({cqe.user_data, cqe.res});
+    }
+    std::atomic_ref{*CqHead}.store(head, std::memory_order_release);
+    Inflight -= n;
+    return n;
+  }
+
+public:
+  explicit Loop(unsigned entries = 256) {
+    if (setup(entries)) {
+      return;
+    }
+    Epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (Epoll < 0) {
+      panic("create event loop error");
+    }
+  }
+
+  Loop(const Loop &) = delete;
+  Loop &operator=(const Loop &) = delete;
+
+  ~Loop() {
+    if (Ring >= 0) {
+      teardown();
+    }
+    if (Epoll >= 0) {
+      close(Epoll);
+    }
+  }
+
+  [[nodiscard]] bool Uring() const { return Ring >= 0; }
+  [[nodiscard]] size_t Pending() const { return Inflight; }
+
+  // Completes once the descriptor is readable, with the events that are set.
+  void Poll(int fd, uint64_t tag) {
+    if (Ring >= 0) {
+      auto sqe = next();
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll32_events = POLLIN;
+      sqe->user_data = tag;
+      return;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = tag;
+    Inflight++;
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      Ready.push_back({tag, -errno});
+      return;
+    }
+    Polled[tag] = fd;
+  }
+
+  // Submits everything queued and appends at least min completions, as many
+  // as there are pending when fewer.
+  size_t Wait(std::vector<Completion> &out, size_t min) {
+    min = std::min(min, Inflight);
+    if (Ring >= 0) {
+      auto n = reap(out);
+      enter(n >= min ? 0 : static_cast<unsigned>(min - n));
+      n += reap(out);
+      while (n < min) {
+        enter(static_cast<unsigned>(min - n));
+        n += reap(out);
+      }
+      return n;
+    }
+    auto n = Ready.size();
+    out.insert(out.end(), Ready.begin(), Ready.end());
+    Inflight -= n;
+    Ready.clear();
+    static constexpr int MaxEvents = 64;
+    epoll_event events[MaxEvents];
+    do {
+      auto ready = epoll_wait(Epoll, events, MaxEvents, n >= min ? 0 : -1);
+      if (ready < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ready <= 0) {
+        break;
+      }
+      for (auto i = 0; i < ready; i++) {
+        auto tag = events[i].data.u64;
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, Polled[tag], nullptr);
+        Polled.erase(tag);
+        out.push_back({tag, static_cast<int>(events[i].events)});
+      }
+      n += static_cast<size_t>(ready);
+      Inflight -= static_cast<size_t>(ready);
+    } while (n < min);
+    return n;
+  }
+};
+
+} // namespace io
+
+namespace shell {
+
+struct Options {
+  // Always run programs from PATH, even for the builtin commands.
+  bool External{};
+};
+
+// Reads lines through a large buffer that grows to hold the longest line.
+class Reader {
+  int Fd;
+  std::vector<char> Buf;
+  size_t Begin{}, End{};
+  bool Eof{};
+
+  bool fill() {
+    if (Begin > 0) {
+      memmove(Buf.data(), Buf.data() + Begin, End - Begin);
+      End -= Begin;
+      Begin = 0;
+    }
+    if (End == Buf.size()) {
+      Buf.resize(Buf.size() * 2);
+    }
+    while (!Eof) {
+      auto n = read(Fd, Buf.data() + End, Buf.size() - End);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        Failed = n < 0 ? errno : 0;
+        Eof = true;
+        break;
+      }
+      auto size = static_cast<size_t>(n);
+      Nul = Nul || memchr(Buf.data() + End, '\0', size);
+      End += size;
+      return true;
+    }
+    return false;
+  }
+
+public:
+  static constexpr size_t BufferSize = 64 * 1024;
+  int Failed{};
+  // Whether a NUL byte has been read so far.
+  bool Nul{};
+
+  explicit Reader(int fd) : Fd{fd}, Buf(BufferSize) {}
+
+  // The next line without its newline, which the last line may lack.
+  bool Line(std::string_view &line, bool &newline) {
+    size_t scanned = 0;
+    while (true) {
+      auto from = Buf.data() + Begin;
+      if (auto nl = static_cast<const char *>(
+              memchr(from + scanned, '\n', End - Begin - scanned))) {
+        line = std::string_view{from, static_cast<size_t>(nl - from)};
+        Begin += line.size() + 1;
+        newline = true;
+        return true;
+      }
+      scanned = End - Begin;
+      if (!fill()) {
+        break;
+      }
+    }
+    if (Begin == End) {
+      return false;
+    }
+    line = std::string_view{Buf.data() + Begin, End - Begin};
+    Begin = End;
+    newline = false;
+    return true;
+  }
+
+  // Whatever is buffered, or the next read.
+  bool Chunk(std::string_view &data) {
+    if (Begin == End) {
+      Begin = End = 0;
+      if (!fill()) {
+        return false;
+      }
+    }
+    data = std::string_view{Buf.data() + Begin, End - Begin};
+    Begin = End;
+    return true;
+  }
+};
+
+class Writer {
+  int Fd;
+  std::vector<char> Buf;
+  size_t Used{};
+
+  void write(const char *p, size_t n) {
+    while (n > 0 && !Broken) {
+      auto written = ::write(Fd, p, n);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written < 0) {
+        Broken = errno;
+        break;
+      }
+      p += written;
+      n -= static_cast<size_t>(written);
+    }
+  }
+
+public:
+  int Broken{};
+
+  explicit Writer(int fd) : Fd{fd}, Buf(Reader::BufferSize) {}
+
+  void Put(std::string_view s) {
+    if (s.size() > Buf.size() - Used) {
+      Flush();
+      if (s.size() >= Buf.size()) {
+        write(s.data(), s.size());
+        return;
+      }
+    }
+    memcpy(Buf.data() + Used, s.data(), s.size());
+    Used += s.size();
+  }
+
+  void Put(char c) {
+    if (Used == Buf.size()) {
+      Flush();
+    }
+    Buf[Used++] = c;
+  }
+
+  bool Flush() {
+    write(Buf.data(), Used);
+    Used = 0;
+    return !Broken;
+  }
+};
+
+// Moves everything from in to out inside the kernel where it can: splice
+// when either end is a pipe, copy_file_range between files, and read and
+// write through a buffer otherwise.
+static inline int Copy(int in, int out) {
+  static constexpr size_t Chunk = 1024 * 1024;
+  struct stat from {}, to{};
+  auto pipes = (fstat(in, &from) == 0 && S_ISFIFO(from.st_mode)) ||
+               (fstat(out, &to) == 0 && S_ISFIFO(to.st_mode));
+  while (true) {
+    auto n = pipes ? splice(in, nullptr, out, nullptr, Chunk, SPLICE_F_MOVE)
+                   : copy_file_range(in, nullptr, out, nullptr, Chunk, 0);
+    if (n == 0) {
+      return 0;
+    }
+    if (n > 0 || errno == EINTR) {
+      continue;
+    }
+    if (errno != EINVAL && errno != EXDEV && errno != ENOSYS &&
+        errno != EOPNOTSUPP && errno != EBADF) {
+      return errno;
+    }
+    break;
+  }
+  Reader r{in};
+  Writer w{out};
+  for (std::string_view data{}; r.Chunk(data) && !w.Broken;) {
+    w.Put(data);
+  }
+  w.Flush();
+  return w.Broken ? w.Broken : r.Failed;
+}
+
+// Copies in to both out and file inside the kernel: tee duplicates what is in
+// the input pipe into the output pipe, and splice then moves the same bytes
+// into the file. Gives up before moving anything when either side is not a
+// pipe, or when the file is not a regular one splice can write to, which
+// rules out files opened to append.
+static inline std::optional<int> Duplicate(int in, int out, int file) {
+  static constexpr size_t Chunk = 1024 * 1024;
+  struct stat from {}, to{}, dest{};
+  if (fstat(in, &from) != 0 || !S_ISFIFO(from.st_mode) ||
+      fstat(out, &to) != 0 || !S_ISFIFO(to.st_mode) ||
+      fstat(file, &dest) != 0 || !S_ISREG(dest.st_mode)) {
+    return {};
+  }
+  if (auto flags = fcntl(file, F_GETFL); flags < 0 || flags & O_APPEND) {
+    return {};
+  }
+  while (true) {
+    auto n = tee(in, out, Chunk, 0);
+    if (n == 0) {
+      return 0;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    for (auto left = static_cast<size_t>(n); left > 0;) {
+      auto moved = splice(in, nullptr, file, nullptr, left, SPLICE_F_MOVE);
+      if (moved < 0 && errno == EINTR) {
+        continue;
+      }
+      if (moved <= 0) {
+        return moved < 0 ? errno : EIO;
+      }
+      left -= static_cast<size_t>(moved);
+    }
+  }
+}
+
+// The builtin commands. Each one parses its arguments and gives up on those
+// it does not support, in which case the program from PATH runs instead, so
+// that output always matches GNU coreutils. A parsed command runs with its
+// input and output descriptors and returns the exit status.
+using Tool = std::function<int(int in, int out)>;
+using Args = std::vector<std::string_view>;
+
+// Whether the locale the commands would run under compares and classifies
+// plain bytes.
+static inline bool ByteLocale(const char *category) {
+  for (auto name : {"LC_ALL", category, "LANG"}) {
+    if (auto value = getenv(name); value && *value) {
+      std::string_view v{value};
+      return v == "C" || v == "POSIX" || v.starts_with("C.");
+    }
+  }
+  return true;
+}
+
+static inline bool Utf8Locale() {
+  for (auto name : {"LC_ALL", "LC_CTYPE", "LANG"}) {
+    if (auto value = getenv(name); value && *value) {
+      std::string_view v{value};
+      return v.find("UTF-8") != std::string_view::npos ||
+             v.find("utf8") != std::string_view::npos;
+    }
+  }
+  return false;
+}
+
+// Rejects what mbrtowc would: stray continuation bytes, overlong forms,
+// surrogates and code points past U+10FFFF.
+static inline bool ValidUtf8(std::string_view s) {
+  for (size_t i = 0; i < s.size(); i++) {
+    auto c = static_cast<unsigned char>(s[i]);
+    if (c < 0x80) {
+      continue;
+    }
+    size_t n = c < 0xc2 ? 0 : c < 0xe0 ? 1 : c < 0xf0 ? 2 : c < 0xf5 ? 3 : 0;
+    if (n == 0 || s.size() - i - 1 < n) {
+      return false;
+    }
+    auto next = static_cast<unsigned char>(s[i + 1]);
+    if ((c == 0xe0 && next < 0xa0) || (c == 0xed && next >= 0xa0) ||
+        (c == 0xf0 && next < 0x90) || (c == 0xf4 && next >= 0x90)) {
+      return false;
+    }
+    for (; n > 0; n--) {
+      if ((static_cast<unsigned char>(s[++i]) & 0xc0) != 0x80) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Counts in byte lanes that the compiler turns into vector compares, added up
+// before they can overflow.
+static inline uint64_t Newlines(std::string_view data) {
+  static constexpr size_t Lanes = 32;
+  uint64_t n = 0;
+  size_t i = 0;
+  while (i + Lanes <= data.size()) {
+    auto end = std::min(data.size(), i + 255 * Lanes);
+    uint8_t lanes[Lanes]{};
+    for (; i + Lanes <= end; i += Lanes) {
+      for (size_t k = 0; k < Lanes; k++) {
+        lanes[k] += data[i + k] == '\n';
+      }
+    }
+    for (auto lane : lanes) {
+      n += lane;
+    }
+  }
+  for (; i < data.size(); i++) {
+    n += data[i] == '\n';
+  }
+  return n;
+}
+
+static inline std::optional<uint64_t> Count(std::string_view s) {
+  uint64_t n{};
+  auto [end, err] = std::from_chars(s.data(), s.data() + s.size(), n);
+  if (s.empty() || err != std::errc{} || end != s.data() + s.size()) {
+    return {};
+  }
+  return n;
+}
+
+// Opens a file argument, - being the input.
+static inline int Open(std::string_view file, int in) {
+  if (file == "-") {
+    return in;
+  }
+  return open(std::string{file}.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+static inline void Complain(const char *tool, std::string_view file, int err) {
+  fprintf(stderr, "%s: %.*s: %s\n", tool, static_cast<int>(file.size()),
+          file.data(), strerror(err));
+}
+
+// Exit status of a command killed by writing to a closed pipe.
+static constexpr int BrokenPipe = 128 + SIGPIPE;
+
+static inline std::optional<Tool> Cat(const Args &args) {
+  for (auto a : args) {
+    if (a.size() > 1 && a[0] == '-') {
+      return {};
+    }
+  }
+  return [files = args](int in, int out) {
+    auto status = 0;
+    auto copy = [&](std::string_view name, int fd) {
+      if (auto err = Copy(fd, out)) {
+        if (err == EPIPE) {
+          return false;
+        }
+        Complain("cat", name, err);
+        status = 1;
+      }
+      return true;
+    };
+    if (files.empty()) {
+      return copy("-", in) ? status : BrokenPipe;
+    }
+    for (auto f : files) {
+      auto fd = Open(f, in);
+      if (fd < 0) {
+        Complain("cat", f, errno);
+        status = 1;
+        continue;
+      }
+      auto ok = copy(f, fd);
+      if (fd != in) {
+        close(fd);
+      }
+      if (!ok) {
+        return BrokenPipe;
+      }
+    }
+    return status;
+  };
+}
+
+static inline std::optional<Tool> Head(const Args &args) {
+  uint64_t n = 10;
+  auto bytes = false;
+  std::optional<std::string_view> file{};
+  for (size_t i = 0; i < args.size(); i++) {
+    auto a = args[i];
+    if (a.size() > 1 && a[0] == '-' && (a[1] == 'n' || a[1] == 'c')) {
+      bytes = a[1] == 'c';
+      auto value = a.size() > 2 ? a.substr(2)
+                   : i + 1 < args.size() ? args[++i]
+                                         : std::string_view{};
+      auto count = Count(value);
+      if (!count) {
+        return {};
+      }
+      n = *count;
+    } else if ((a.size() > 1 && a[0] == '-') || file) {
+      return {};
+    } else {
+      file = a;
+    }
+  }
+  return [n, bytes, file](int in, int out) {
+    auto fd = file ? Open(*file, in) : in;
+    if (fd < 0) {
+      Complain("head", *file, errno);
+      return 1;
+    }
+    Reader r{fd};
+    Writer w{out};
+    uint64_t left = n;
+    if (bytes) {
+      for (std::string_view data{}; left > 0 && r.Chunk(data);) {
+        data = data.substr(0, left);
+        w.Put(data);
+        left -= data.size();
+      }
+    } else {
+      std::string_view line{};
+      for (auto newline = false; left > 0 && r.Line(line, newline); left--) {
+        w.Put(line);
+        if (newline) {
+          w.Put('\n');
+        }
+      }
+    }
+    w.Flush();
+    if (fd != in) {
+      close(fd);
+    }
+    if (w.Broken == EPIPE) {
+      return BrokenPipe;
+    }
+    if (r.Failed) {
+      auto name = file.value_or("standard input");
+      fprintf(stderr, "head: error reading '%.*s': %s\n",
+              static_cast<int>(name.size()), name.data(), strerror(r.Failed));
+      return 1;
+    }
+    return w.Broken ? 1 : 0;
+  };
+}
+
+static inline std::optional<Tool> Wc(const Args &args) {
+  bool lines{}, words{}, chars{};
+  std::optional<std::string_view> file{};
+  for (auto a : args) {
+    if (a.size() > 1 && a[0] == '-') {
+      for (auto c : a.substr(1)) {
+        if (c == 'l') {
+          lines = true;
+        } else if (c == 'w') {
+          words = true;
+        } else if (c == 'c') {
+          chars = true;
+        } else {
+          return {};
+        }
+      }
+    } else if (file) {
+      return {};
+    } else {
+      file = a;
+    }
+  }
+  if (!lines && !words && !chars) {
+    lines = words = chars = true;
+  }
+  if (words && !ByteLocale("LC_CTYPE")) {
+    return {};
+  }
+  return [lines, words, chars, file](int in, int out) {
+    auto fd = file ? Open(*file, in) : in;
+    if (fd < 0) {
+      Complain("wc", *file, errno);
+      return 1;
+    }
+    Reader r{fd};
+    uint64_t counts[3]{};
+    auto inWord = false;
+    for (std::string_view data{}; r.Chunk(data);) {
+      counts[2] += data.size();
+      if (!words) {
+        if (lines) {
+          counts[0] += Newlines(data);
+        }
+        continue;
+      }
+      for (auto c : data) {
+        if (c == '\n' || c == ' ' || (c >= '\t' && c <= '\r')) {
+          counts[0] += c == '\n';
+          counts[1] += inWord;
+          inWord = false;
+        } else if (c > ' ' && c < 0x7f) {
+          inWord = true;
+        }
+      }
+    }
+    counts[1] += inWord;
+    // Counts are aligned to the size of a regular input, or to 7 digits for
+    // anything else, unless a single one is printed.
+    size_t width = 1;
+    struct stat st {};
+    if (lines + words + chars > 1) {
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        for (auto size = st.st_size; size >= 10; size /= 10) {
+          width++;
+        }
+      } else {
+        width = 7;
+      }
+    }
+    if (fd != in) {
+      close(fd);
+    }
+    // GNU wc still prints what it counted before a read error.
+    auto status = 0;
+    if (r.Failed) {
+      Complain("wc", file.value_or("-"), r.Failed);
+      status = 1;
+    }
+    std::string text{};
+    bool shown[3]{lines, words, chars};
+    for (size_t i = 0; i < 3; i++) {
+      if (shown[i]) {
+        auto n = std::to_string(counts[i]);
+        if (!text.empty()) {
+          text += ' ';
+        }
+        if (n.size() < width) {
+          text.append(width - n.size(), ' ');
+        }
+        text += n;
+      }
+    }
+    if (file) {
+      text += ' ';
+      text += *file;
+    }
+    text += '\n';
+    Writer w{out};
+    w.Put(text);
+    w.Flush();
+    return w.Broken == EPIPE ? BrokenPipe : w.Broken ? 1 : status;
+  };
+}
+
+// Fixed patterns only: basic regular expressions without special characters
+// and -F patterns.
+static inline std::optional<Tool> Grep(const Args &args) {
+  bool invert{}, count{}, quiet{}, fixed{};
+  std::optional<std::string_view> pattern{}, file{};
+  for (auto a : args) {
+    if (a.size() > 1 && a[0] == '-') {
+      for (auto c : a.substr(1)) {
+        if (c == 'v') {
+          invert = true;
+        } else if (c == 'c') {
+          count = true;
+        } else if (c == 'q') {
+          quiet = true;
+        } else if (c == 'F') {
+          fixed = true;
+        } else {
+          return {};
+        }
+      }
+    } else if (!pattern) {
+      pattern = a;
+    } else if (!file) {
+      file = a;
+    } else {
+      return {};
+    }
+  }
+  if (!pattern || (!fixed && pattern->find_first_of("\\.[]*^$") !=
+                                  std::string_view::npos)) {
+    return {};
+  }
+  auto utf8 = Utf8Locale();
+  if (!utf8 && !ByteLocale("LC_CTYPE")) {
+    return {};
+  }
+  return [=](int in, int out) {
+    auto fd = file ? Open(*file, in) : in;
+    if (fd < 0) {
+      Complain("grep", *file, errno);
+      return 2;
+    }
+    std::string_view name = file && *file != "-" ? *file : "(standard input)";
+    Reader r{fd};
+    Writer w{out};
+    uint64_t selected{};
+    // Matching lines of binary input are not printed, GNU grep tells so
+    // once instead.
+    auto binary = false;
+    std::string_view line{};
+    for (auto newline = false; r.Line(line, newline);) {
+      auto found = pattern->empty() ||
+                   memmem(line.data(), line.size(), pattern->data(),
+                          pattern->size()) != nullptr;
+      if (found == invert) {
+        continue;
+      }
+      selected++;
+      if (quiet) {
+        break;
+      }
+      if (count || w.Broken) {
+        continue;
+      }
+      if (r.Nul) {
+        binary = true;
+        break;
+      }
+      if (utf8 && !ValidUtf8(line)) {
+        binary = true;
+        continue;
+      }
+      w.Put(line);
+      w.Put('\n');
+    }
+    if (count) {
+      w.Put(std::to_string(selected));
+      w.Put('\n');
+    }
+    w.Flush();
+    if (fd != in) {
+      close(fd);
+    }
+    if (binary && !w.Broken) {
+      fprintf(stderr, "grep: %.*s: binary file matches\n",
+              static_cast<int>(name.size()), name.data());
+    }
+    if (w.Broken == EPIPE) {
+      return BrokenPipe;
+    }
+    return w.Broken || r.Failed ? 2 : selected > 0 ? 0 : 1;
+  };
+}
+
+// Fields with -d and -f, or bytes with -b and -c, out of positions given as
+// N, N-M, N- and -M.
+static inline std::optional<Tool> Cut(const Args &args) {
+  std::optional<std::string_view> list{};
+  auto fields = false, only = false;
+  char delim = '\t';
+  std::vector<std::string_view> files{};
+  for (size_t i = 0; i < args.size(); i++) {
+    auto a = args[i];
+    if (a.size() < 2 || a[0] != '-') {
+      files.push_back(a);
+      continue;
+    }
+    if (a == "-s") {
+      only = true;
+      continue;
+    }
+    auto value = a.size() > 2 ? a.substr(2)
+                 : i + 1 < args.size() ? args[++i]
+                                       : std::string_view{};
+    if (a[1] == 'd' && value.size() == 1) {
+      delim = value[0];
+    } else if ((a[1] == 'f' || a[1] == 'b' || a[1] == 'c') && !list) {
+      list = value;
+      fields = a[1] == 'f';
+    } else {
+      return {};
+    }
+  }
+  if (!list || (!fields && (only || delim != '\t'))) {
+    return {};
+  }
+  // Selected positions from one, and the first of an open range.
+  static constexpr uint64_t MaxPosition = 1 << 20;
+  std::vector<bool> picked{};
+  size_t open = SIZE_MAX;
+  for (size_t from = 0; from <= list->size();) {
+    auto to = std::min(list->find(',', from), list->size());
+    auto range = list->substr(from, to - from);
+    from = to + 1;
+    auto dash = range.find('-');
+    auto lo = dash == 0 ? std::optional<uint64_t>{1}
+                        : Count(range.substr(0, dash));
+    auto hi = dash == std::string_view::npos ? lo
+              : dash + 1 == range.size()
+                  ? std::optional<uint64_t>{SIZE_MAX}
+                  : Count(range.substr(dash + 1));
+    if (!lo || !hi || *lo == 0 || *lo > *hi ||
+        (*hi != SIZE_MAX && *hi > MaxPosition)) {
+      return {};
+    }
+    if (*hi == SIZE_MAX) {
+      open = std::min(open, static_cast<size_t>(*lo));
+      continue;
+    }
+    picked.resize(std::max(picked.size(), static_cast<size_t>(*hi) + 1));
+    for (auto k = *lo; k <= *hi; k++) {
+      picked[k] = true;
+    }
+  }
+  auto wanted = [picked, open](size_t k) {
+    return k >= open || (k < picked.size() && picked[k]);
+  };
+  return [=](int in, int out) {
+    Writer w{out};
+    auto status = 0;
+    auto cut = [&](std::string_view name, int fd) {
+      Reader r{fd};
+      std::string_view line{};
+      for (auto newline = false; r.Line(line, newline) && !w.Broken;) {
+        if (!fields) {
+          for (size_t k = 0; k < line.size(); k++) {
+            if (wanted(k + 1)) {
+              w.Put(line[k]);
+            }
+          }
+          w.Put('\n');
+          continue;
+        }
+        if (line.find(delim) == std::string_view::npos) {
+          if (!only) {
+            w.Put(line);
+            w.Put('\n');
+          }
+          continue;
+        }
+        auto first = true;
+        size_t k = 1;
+        for (size_t from = 0; from <= line.size(); k++) {
+          auto to = std::min(line.find(delim, from), line.size());
+          if (wanted(k)) {
+            if (!first) {
+              w.Put(delim);
+            }
+            w.Put(line.substr(from, to - from));
+            first = false;
+          }
+          from = to + 1;
+        }
+        w.Put('\n');
+      }
+      if (r.Failed) {
+        Complain("cut", name, r.Failed);
+        status = 1;
+      }
+    };
+    if (files.empty()) {
+      cut("-", in);
+    }
+    for (auto f : files) {
+      auto fd = Open(f, in);
+      if (fd < 0) {
+        Complain("cut", f, errno);
+        status = 1;
+        continue;
+      }
+      cut(f, fd);
+      if (fd != in) {
+        close(fd);
+      }
+    }
+    w.Flush();
+    return w.Broken == EPIPE ? BrokenPipe : w.Broken ? 1 : status;
+  };
+}
+
+// Plain byte order, reversed by -r and without duplicates by -u.
+static inline std::optional<Tool> Sort(const Args &args) {
+  bool reverse{}, unique{};
+  std::vector<std::string_view> files{};
+  for (auto a : args) {
+    if (a.size() > 1 && a[0] == '-') {
+      for (auto c : a.substr(1)) {
+        if (c == 'r') {
+          reverse = true;
+        } else if (c == 'u') {
+          unique = true;
+        } else {
+          return {};
+        }
+      }
+    } else {
+      files.push_back(a);
+    }
+  }
+  if (!ByteLocale("LC_COLLATE")) {
+    return {};
+  }
+  return [=](int in, int out) {
+    std::string text{};
+    auto slurp = [&](std::string_view name, int fd) {
+      Reader r{fd};
+      for (std::string_view data{}; r.Chunk(data);) {
+        text += data;
+      }
+      if (r.Failed) {
+        fprintf(stderr, "sort: read failed: %.*s: %s\n",
+                static_cast<int>(name.size()), name.data(),
+                strerror(r.Failed));
+        return false;
+      }
+      if (!text.empty() && text.back() != '\n') {
+        text += '\n';
+      }
+      return true;
+    };
+    if (files.empty() && !slurp("-", in)) {
+      return 2;
+    }
+    for (auto f : files) {
+      auto fd = Open(f, in);
+      if (fd < 0) {
+        fprintf(stderr, "sort: cannot read: %.*s: %s\n",
+                static_cast<int>(f.size()), f.data(), strerror(errno));
+        return 2;
+      }
+      auto ok = slurp(f, fd);
+      if (fd != in) {
+        close(fd);
+      }
+      if (!ok) {
+        return 2;
+      }
+    }
+    std::vector<std::string_view> lines{};
+    for (size_t from = 0; from < text.size();) {
+      auto to = text.find('\n', from);
+      lines.emplace_back(text.data() + from, to - from);
+      from = to + 1;
+    }
+    if (reverse) {
+      std::sort(lines.begin(), lines.end(), std::greater<>{});
+    } else {
+      std::sort(lines.begin(), lines.end());
+    }
+    if (unique) {
+      lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+    }
+    Writer w{out};
+    for (auto line : lines) {
+      w.Put(line);
+      w.Put('\n');
+    }
+    w.Flush();
+    return w.Broken == EPIPE ? BrokenPipe : w.Broken ? 1 : 0;
+  };
+}
+
+// Copies the input to the output and to every file, which -a appends to. A
+// single file between pipes takes the zero-copy path of Duplicate unless it
+// is appended to.
+static inline std::optional<Tool> Tee(const Args &args) {
+  auto append = false;
+  std::vector<std::string_view> files{};
+  for (auto a : args) {
+    if (a == "-a") {
+      append = true;
+    } else if (a.starts_with("-")) {
+      return {};
+    } else {
+      files.push_back(a);
+    }
+  }
+  return [=](int in, int out) {
+    auto status = 0;
+    std::vector<std::pair<std::string_view, int>> opened{};
+    for (auto f : files) {
+      auto flags =
+          O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+      auto fd = open(std::string{f}.c_str(), flags, 0666);
+      if (fd < 0) {
+        Complain("tee", f, errno);
+        status = 1;
+        continue;
+      }
+      opened.emplace_back(f, fd);
+    }
+    std::optional<int> err{};
+    if (opened.empty()) {
+      err = Copy(in, out);
+    } else if (opened.size() == 1 && !append) {
+      err = Duplicate(in, out, opened[0].second);
+    }
+    if (err && *err && *err != EPIPE) {
+      Complain("tee", opened.empty() ? "-" : opened[0].first, *err);
+      status = 1;
+    }
+    auto broken = err == EPIPE;
+    if (!err) {
+      Reader r{in};
+      Writer w{out};
+      std::vector<Writer> copies{};
+      for (auto [f, fd] : opened) {
+        copies.emplace_back(fd);
+      }
+      for (std::string_view data{}; r.Chunk(data) && !w.Broken;) {
+        w.Put(data);
+        for (auto &c : copies) {
+          c.Put(data);
+        }
+      }
+      w.Flush();
+      for (size_t i = 0; i < copies.size(); i++) {
+        if (!copies[i].Flush()) {
+          Complain("tee", opened[i].first, copies[i].Broken);
+          status = 1;
+        }
+      }
+      if (r.Failed) {
+        Complain("tee", "-", r.Failed);
+        status = 1;
+      }
+      if (w.Broken && w.Broken != EPIPE) {
+        Complain("tee", "standard output", w.Broken);
+        status = 1;
+      }
+      broken = w.Broken == EPIPE;
+    }
+    for (auto [f, fd] : opened) {
+      close(fd);
+    }
+    return broken ? BrokenPipe : status;
+  };
+}
+
+using Parse = std::optional<Tool> (*)(const Args &);
+
+inline constexpr std::pair<const char *, Parse> Tools[] = {
+    {"cat", Cat},   {"cut", Cut},   {"grep", Grep}, {"head", Head},
+    {"sort", Sort}, {"tee", Tee},   {"wc", Wc},
+};
+
+// Starts the commands of the shell DSL. Children are created with
+// posix_spawn, which glibc implements with a vfork-style clone, so launching
+// does not copy the page tables of the heap and the JIT code. Programs are
+// looked up in PATH once per name, the environment is captured once, and the
+// argument vectors of every pipeline are built on its first run, leaving only
+// the interpolated numbers to fill in.
+//
+// The commands of a pipeline are connected by pipes and redirected to their
+// files by the children themselves, so no data passes through this process.
+// Builtin commands are found before PATH and run on threads of their own in
+// the foreground, the last one of a pipeline on the calling thread.
+//
+// Every pipeline is a job, whose children are awaited through their pidfds
+// on the event loop, all in one batch.
+class Launcher {
+  struct Command {
+    std::vector<std::string> Words{};
+    std::vector<char *> Argv{};
+    // Argv positions of the holes.
+    std::vector<size_t> Holes{};
+    const std::optional<std::string> *Path{};
+    Parse Builtin{};
+    const char *In{}, *Out{};
+    bool Append{};
+  };
+
+  struct Pipeline {
+    std::vector<Command> Commands{};
+    // A buffer for each hole, in the order of the holes of the commands.
+    std::vector<std::array<char, 24>> Numbers{};
+  };
+
+  // Children, with a pidfd each when the kernel supports them.
+  struct Child {
+    uint64_t Job{};
+    int Fd{-1};
+    bool Last{};
+  };
+
+  struct Job {
+    size_t Running{};
+    // The status of the last command, once it is known.
+    int Status{};
+  };
+
+  std::vector<std::string> Env{};
+  std::vector<char *> Envp{};
+  std::vector<std::string> Dirs{};
+  std::unordered_map<std::string, std::optional<std::string>> Found{};
+  std::unordered_map<const parsing::Expr *, Pipeline> Pipelines{};
+  std::unordered_map<pid_t, Child> Children{};
+  std::unordered_map<uint64_t, Job> Jobs{};
+  uint64_t NextJob{1};
+  io::Loop Loop{};
+  std::vector<io::Loop::Completion> Completions{};
+  Options Opts;
+  posix_spawnattr_t Attr{};
+
+  const std::optional<std::string> &lookup(const std::string &name) {
+    if (auto it = Found.find(name); it != Found.end()) {
+      return it->second;
+    }
+    auto &path = Found[name];
+    if (name.find('/') != std::string::npos) {
+      path = name;
+      return path;
+    }
+    for (const auto &dir : Dirs) {
+      auto candidate = dir + "/" + name;
+      if (access(candidate.c_str(), X_OK) == 0) {
+        path = std::move(candidate);
+        break;
+      }
+    }
+    return path;
+  }
+
+  Pipeline &prepare(const parsing::Expr &e) {
+    using parsing::WordKind;
+    auto [it, fresh] = Pipelines.try_emplace(&e);
+    auto &p = it->second;
+    if (!fresh) {
+      return p;
+    }
+    p.Commands.emplace_back();
+    for (const auto &w : e.Words) {
+      auto &cmd = p.Commands.back();
+      switch (w.Kind) {
+      case WordKind::Hole:
+        cmd.Holes.push_back(cmd.Words.size());
+        [[fallthrough]];
+      case WordKind::Text:
+        cmd.Words.push_back(w.Text);
+        break;
+      case WordKind::Pipe:
+        p.Commands.emplace_back();
+        break;
+      case WordKind::In:
+        cmd.In = w.Text.c_str();
+        break;
+      case WordKind::Out:
+      case WordKind::Append:
+        cmd.Out = w.Text.c_str();
+        cmd.Append = w.Kind == WordKind::Append;
+        break;
+      }
+    }
+    for (auto &cmd : p.Commands) {
+      for (auto &w : cmd.Words) {
+        cmd.Argv.push_back(w.data());
+      }
+      cmd.Argv.push_back(nullptr);
+      cmd.Path = &lookup(cmd.Words.front());
+      for (auto [name, parse] : Tools) {
+        if (!Opts.External && cmd.Words.front() == name) {
+          cmd.Builtin = parse;
+        }
+      }
+      p.Numbers.resize(p.Numbers.size() + cmd.Holes.size());
+    }
+    return p;
+  }
+
+  static int status(const siginfo_t &info) {
+    return info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+  }
+
+  static void join(pid_t pid, siginfo_t &info) {
+    while (waitid(P_PID, static_cast<id_t>(pid), &info, WEXITED) != 0) {
+      if (errno != EINTR) {
+        panic("wait for command error");
+      }
+    }
+  }
+
+  void settle(std::unordered_map<pid_t, Child>::iterator it,
+              const siginfo_t &info) {
+    auto &job = Jobs[it->second.Job];
+    if (it->second.Last) {
+      job.Status = status(info);
+    }
+    job.Running--;
+    if (it->second.Fd >= 0) {
+      close(it->second.Fd);
+    }
+    Children.erase(it);
+  }
+
+  // Reaps the children that have exited, or waits for one to exit when asked
+  // to block. Children without a pidfd are checked one by one.
+  void reap(bool block) {
+    size_t reaped = 0;
+    for (auto it = Children.begin(); it != Children.end();) {
+      auto next = std::next(it);
+      siginfo_t info{};
+      if (it->second.Fd < 0 &&
+          waitid(P_PID, static_cast<id_t>(it->first), &info,
+                 WEXITED | WNOHANG) == 0 &&
+          info.si_pid != 0) {
+        settle(it, info);
+        reaped++;
+      }
+      it = next;
+    }
+    block = block && reaped == 0;
+    if (Loop.Pending() == 0) {
+      if (block && !Children.empty()) {
+        siginfo_t info{};
+        join(Children.begin()->first, info);
+        settle(Children.begin(), info);
+      }
+      return;
+    }
+    Completions.clear();
+    Loop.Wait(Completions, block ? 1 : 0);
+    for (const auto &c : Completions) {
+      auto it = Children.find(static_cast<pid_t>(c.Tag));
+      siginfo_t info{};
+      while (waitid(static_cast<idtype_t>(P_PIDFD),
+                    static_cast<id_t>(it->second.Fd), &info, WEXITED) != 0 &&
+             errno == EINTR) {
+      }
+      settle(it, info);
+    }
+  }
+
+  // Starts one command of a pipeline reading from in and writing to out,
+  // unless its own redirections say otherwise. Returns the pid, or zero with
+  // the exit status of a command that could not start.
+  pid_t spawn(const Command &cmd, int in, int out, int &failed) {
+    const auto &path = *cmd.Path;
+    if (!path) {
+      fprintf(stderr, "%s: command not found\n", cmd.Words.front().c_str());
+      failed = 127;
+      return 0;
+    }
+    posix_spawn_file_actions_t actions{};
+    posix_spawn_file_actions_init(&actions);
+    if (in >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    }
+    if (out >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    }
+    if (cmd.In) {
+      posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, cmd.In,
+                                       O_RDONLY, 0);
+    }
+    if (cmd.Out) {
+      auto flags = O_WRONLY | O_CREAT | (cmd.Append ? O_APPEND : O_TRUNC);
+      posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd.Out, flags,
+                                       0666);
+    }
+    pid_t pid{};
+    auto err = posix_spawn(&pid, path->c_str(), &actions, &Attr,
+                           cmd.Argv.data(), Envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    if (err) {
+      fprintf(stderr, "%s: %s\n", cmd.Words.front().c_str(), strerror(err));
+      failed = err == ENOENT ? 127 : 126;
+      return 0;
+    }
+    Launched++;
+    return pid;
+  }
+
+  // Runs a builtin command, taking over the descriptors it is given.
+  // Blocks SIGPIPE on the thread running a builtin, so that writing to a
+  // closed pipe fails with EPIPE instead of killing the process, whatever the
+  // host made of the signal. One raised meanwhile is taken before the mask is
+  // restored.
+  class QuietPipe {
+    sigset_t Pipe{};
+    sigset_t Saved{};
+    bool Pending{};
+
+    static bool pending() {
+      sigset_t set{};
+      sigpending(&set);
+      return sigismember(&set, SIGPIPE) == 1;
+    }
+
+  public:
+    QuietPipe() {
+      sigemptyset(&Pipe);
+      sigaddset(&Pipe, SIGPIPE);
+      Pending = pending();
+      pthread_sigmask(SIG_BLOCK, &Pipe, &Saved);
+    }
+
+    QuietPipe(const QuietPipe &) = delete;
+    QuietPipe &operator=(const QuietPipe &) = delete;
+
+    ~QuietPipe() {
+      if (!Pending && pending()) {
+        timespec now{};
+        sigtimedwait(&Pipe, nullptr, &now);
+      }
+      pthread_sigmask(SIG_SETMASK, &Saved, nullptr);
+    }
+  };
+
+  static int run(const Tool &tool, const Command &cmd, int in, int out) {
+    QuietPipe quiet{};
+    auto status = 0;
+    auto redirect = [&](const char *file, int flags, int &fd) {
+      if (!file) {
+        return;
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+      fd = open(file, flags | O_CLOEXEC, 0666);
+      if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        status = 1;
+      }
+    };
+    redirect(cmd.In, O_RDONLY, in);
+    redirect(cmd.Out, O_WRONLY | O_CREAT | (cmd.Append ? O_APPEND : O_TRUNC),
+             out);
+    if (status == 0) {
+      status =
+          tool(in >= 0 ? in : STDIN_FILENO, out >= 0 ? out : STDOUT_FILENO);
+    }
+    for (auto fd : {in, out}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    return status;
+  }
+
+public:
+  // Background children running at once before a launch waits for one.
+  static constexpr size_t MaxChildren = 256;
+  // Pipes between commands are grown to this size where the system allows,
+  // so that streaming stages switch less often.
+  static constexpr int PipeSize = 1024 * 1024;
+  uint64_t Launched{};
+
+  // Programs start with the default action for SIGPIPE, even when the host
+  // ignores it.
+  explicit Launcher(const Options &opts) : Opts{opts} {
+    for (auto env = environ; *env; env++) {
+      Env.emplace_back(*env);
+    }
+    for (auto &e : Env) {
+      Envp.push_back(e.data());
+    }
+    Envp.push_back(nullptr);
+    if (auto path = getenv("PATH")) {
+      for (auto p = path;; p++) {
+        auto end = strchrnul(p, ':');
+        Dirs.emplace_back(p, end);
+        if (Dirs.back().empty()) {
+          Dirs.back() = ".";
+        }
+        if (*end == '\0') {
+          break;
+        }
+        p = end;
+      }
+    }
+    sigset_t defaults{};
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&Attr);
+    posix_spawnattr_setsigdefault(&Attr, &defaults);
+    posix_spawnattr_setflags(&Attr,
+                             POSIX_SPAWN_USEVFORK | POSIX_SPAWN_SETSIGDEF);
+  }
+
+  Launcher(const Launcher &) = delete;
+  Launcher &operator=(const Launcher &) = delete;
+
+  ~Launcher() {
+    while (!Children.empty()) {
+      reap(true);
+    }
+    posix_spawnattr_destroy(&Attr);
+  }
+
+  // Runs the pipeline with the given numbers in its holes. Returns the exit
+  // status of its last command, 128 plus the signal for a killed command and
+  // 127 when the program is not found, or right away the job to wait for in
+  // the background.
+  int64_t Run(const parsing::Expr &e, const int64_t *numbers) {
+    auto job = Start(e, numbers);
+    return e.Background ? static_cast<int64_t>(job) : Wait(job);
+  }
+
+  // The status of a job, 127 for an unknown one. A job is only waited for
+  // once.
+  int Wait(uint64_t id) {
+    auto it = Jobs.find(id);
+    if (it == Jobs.end()) {
+      return 127;
+    }
+    while (it->second.Running > 0) {
+      reap(true);
+    }
+    auto status = it->second.Status;
+    Jobs.erase(it);
+    return status;
+  }
+
+  uint64_t Start(const parsing::Expr &e, const int64_t *numbers) {
+    auto &p = prepare(e);
+    size_t hole = 0;
+    for (auto &cmd : p.Commands) {
+      for (auto i : cmd.Holes) {
+        auto &buf = p.Numbers[hole];
+        auto end = std::to_chars(buf.data(), buf.data() + buf.size() - 1,
+                                 numbers[hole])
+                       .ptr;
+        *end = '\0';
+        cmd.Argv[i] = buf.data();
+        hole++;
+      }
+    }
+    if (!Children.empty()) {
+      reap(Children.size() >= MaxChildren);
+    }
+    fflush(stdout);
+
+    auto id = NextJob++;
+    auto &job = Jobs[id];
+    std::vector<std::thread> threads{};
+    auto in = -1;
+    for (size_t i = 0; i < p.Commands.size(); i++) {
+      const auto &cmd = p.Commands[i];
+      std::optional<Tool> tool{};
+      if (cmd.Builtin && !e.Background) {
+        tool = cmd.Builtin(Args(cmd.Argv.begin() + 1, cmd.Argv.end() - 1));
+      }
+      int pipe[2]{-1, -1};
+      if (i + 1 < p.Commands.size()) {
+        if (pipe2(pipe, O_CLOEXEC) != 0) {
+          panic("create pipe error");
+        }
+        fcntl(pipe[1], F_SETPIPE_SZ, PipeSize);
+      }
+      auto last = i + 1 == p.Commands.size();
+      if (tool && last) {
+        job.Status = run(*tool, cmd, in, pipe[1]);
+      } else if (tool) {
+        threads.emplace_back(
+            [tool = std::move(*tool), &cmd, in, out = pipe[1]] {
+              run(tool, cmd, in, out);
+            });
+      } else {
+        auto pid = spawn(cmd, in, pipe[1], job.Status);
+        if (in >= 0) {
+          close(in);
+        }
+        if (pipe[1] >= 0) {
+          close(pipe[1]);
+        }
+        if (pid != 0) {
+          auto fd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+          Children[pid] = {id, fd, last};
+          job.Running++;
+          if (fd >= 0) {
+            Loop.Poll(fd, static_cast<uint64_t>(pid));
+          }
+        }
+      }
+      in = pipe[0];
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    return id;
+  }
+};
+
+} // namespace shell
+
+namespace eval {
+
+using gc::Closure;
+using gc::Frame;
+using gc::Value;
+
+class Interpreter {
+  const parsing::Program &P;
+  jit::Options Opts;
+  std::vector<jit::Slot> Slots;
+  gc::Heap Heap;
+  // The collector finds every reference the interpreter holds in these two,
+  // so values that must survive an allocation are kept on the stack and
+  // addressed by index. Frames are pushed as values too. Native frames only
+  // hold numbers, and calls from native code back into the interpreter carry
+  // on with the same stack.
+  gc::RootStack Stack{};
+  std::vector<Value> Vals;
+  std::vector<bool> Evaluated;
+  std::vector<bool> Evaluating;
+  jit::Compiler Compiler;
+  // Native code compiled ahead of time and shared with other interpreters.
+  std::shared_ptr<gcc_jit_result> Image{};
+  // Started by the first command, so that scripts and hosts running none
+  // neither capture the environment nor open an event loop.
+  std::optional<shell::Launcher> Shell{};
+  shell::Options ShellOpts;
+  // Spawned tasks until they are awaited, declared before the pool so that
+  // they outlive its workers.
+  std::unordered_map<int64_t, std::unique_ptr<task::Task>> Tasks{};
+  int64_t NextTask{};
+  // Functions found to run natively with everything they call.
+  std::vector<bool> Detached;
+  std::map<std::pair<jit::Pattern, size_t>, jit::Kernel> Kernels{};
+  std::unordered_map<const parsing::Expr *,
+                     std::pair<void *, jit::Trampoline>>
+      Externs{};
+  task::Channels Chans{};
+  task::Pool Scheduler;
+
+  static constexpr size_t NoEnv = SIZE_MAX;
+
+  // The top-level function whose body is being evaluated, used to spot self
+  // tail calls, which are the loops of the language. The arguments of the next
+  // iteration are left on top of the stack.
+  std::optional<size_t> Current{};
+  bool Looping{};
+
+  // Native code is compiled with unwind tables, so running out of memory or a
+  // fault under its frames unwinds through them to where the interpreter was
+  // entered.
+  static int64_t interpreted(jit::Slot *self, const int64_t *args) {
+    auto &interp = *self->Owner;
+    auto base = interp.Stack.Size();
+    auto n = self->Def->Params.size();
+    for (size_t i = 0; i < n; i++) {
+      interp.Stack.Push(interp.Heap.Number(args[i]));
+    }
+    auto ret = interp.invoke(static_cast<size_t>(self - interp.Slots.data()),
+                             base, n);
+    interp.Stack.Truncate(base);
+    if (!gc::Heap::IsNumber(ret)) {
+      fail("function value escaped into native code");
+    }
+    return gc::Heap::Num(ret);
+  }
+
+  bool numeric(size_t base, size_t n) const {
+    for (size_t i = 0; i < n; i++) {
+      if (!gc::Heap::IsNumber(Stack[base + i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Initial entry of eligible functions under lazy compilation: compiles the
+  // function together with its small callees and patches their slots.
+  static int64_t lazy(jit::Slot *self, const int64_t *args) {
+    auto &interp = *self->Owner;
+    if (self->State.load(std::memory_order_relaxed) == jit::Tier::Interpreted) {
+      auto index = static_cast<size_t>(self - interp.Slots.data());
+      interp.Compiler.Compile(interp.group(index), "lazy");
+    }
+    if (self->State.load(std::memory_order_relaxed) != jit::Tier::Native) {
+      self->Code.store(interpreted, std::memory_order_relaxed);
+    }
+    return self->Code.load(std::memory_order_acquire)(self, args);
+  }
+
+  std::vector<size_t> group(size_t index) {
+    std::vector<size_t> group{index};
+    Slots[index].State.store(jit::Tier::Queued, std::memory_order_relaxed);
+    for (size_t i = 0; i < group.size(); i++) {
+      std::vector<size_t> callees{};
+      jit::Callees(P, P.Defs[group[i]].Ret, callees);
+      for (auto callee : callees) {
+        auto &slot = Slots[callee];
+        if (group.size() >= Opts.MaxGroup) {
+          return group;
+        }
+        if (slot.Eligible &&
+            slot.State.load(std::memory_order_relaxed) ==
+                jit::Tier::Interpreted &&
+            opt::Size(slot.Def->Ret) <= Opts.SmallCallee &&
+            slot.Def->Level == P.Defs[index].Level) {
+          slot.State.store(jit::Tier::Queued, std::memory_order_relaxed);
+          group.push_back(callee);
+        }
+      }
+    }
+    return group;
+  }
+
+  void tierUp(jit::Slot &slot, size_t index) {
+    if (Opts.JIT != jit::Mode::Tiered || !slot.Eligible) {
+      return;
+    }
+    if (slot.Calls.load(std::memory_order_relaxed) < Opts.CallThreshold &&
+        slot.Loops.load(std::memory_order_relaxed) < Opts.LoopThreshold) {
+      return;
+    }
+    auto expected = jit::Tier::Interpreted;
+    if (slot.State.compare_exchange_strong(expected, jit::Tier::Queued)) {
+      Compiler.Enqueue(index);
+    }
+  }
+
+  Value native(jit::Slot &slot, size_t base, size_t n) {
+    std::vector<int64_t> raw{};
+    for (size_t i = 0; i < n; i++) {
+      raw.push_back(gc::Heap::Num(Stack[base + i]));
+    }
+    auto code = slot.Code.load(std::memory_order_acquire);
+    return Heap.Number(code(&slot, raw.data()));
+  }
+
+  // Counts into the same sites as instrumented native code.
+  template <typename Node> pgo::Site *site(const Node &node) {
+    return Opts.Instrument ? &Opts.Profile->At(node) : nullptr;
+  }
+
+  shell::Launcher &launcher() {
+    if (!Shell) {
+      Shell.emplace(ShellOpts);
+    }
+    return *Shell;
+  }
+
+  // Allocates a frame binding the parameters to the values on the stack. The
+  // caller links it to its enclosing frame.
+  Frame *bind(const std::vector<parsing::Param> &params, size_t base,
+              size_t n) {
+    if (params.size() != n) {
+      fail("arity mismatch");
+    }
+    auto frame = Heap.NewFrame(static_cast<uint32_t>(n));
+    for (size_t i = 0; i < n; i++) {
+      auto &var = frame->Vars()[i];
+      var.ID = params[i].ID;
+      Heap.Write(frame, var.Val, Stack[base + i]);
+    }
+    return frame;
+  }
+
+  Value invoke(size_t index, size_t base, size_t n) {
+    auto &slot = Slots[index];
+    slot.Calls.fetch_add(1, std::memory_order_relaxed);
+    tierUp(slot, index);
+    auto counter = site(*slot.Def);
+    if (counter) {
+      counter->Count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    auto caller = Current;
+    Current = index;
+    auto env = Stack.Size();
+    Stack.Push(Value::Of(bind(slot.Def->Params, base, n)));
+    Value ret{};
+    while (true) {
+      Looping = false;
+      ret = Eval(slot.Def->Ret, env, true);
+      if (!Looping) {
+        break;
+      }
+      slot.Loops.fetch_add(1, std::memory_order_relaxed);
+      tierUp(slot, index);
+      if (counter) {
+        counter->Taken.fetch_add(1, std::memory_order_relaxed);
+      }
+      // Finish the loop natively once the compiled code is in.
+      if (slot.State.load(std::memory_order_relaxed) == jit::Tier::Native &&
+          numeric(env + 1, n)) {
+        ret = native(slot, env + 1, n);
+        Looping = false;
+        break;
+      }
+      auto frame = bind(slot.Def->Params, env + 1, n);
+      Stack[env] = Value::Of(frame);
+      Stack.Truncate(env + 1);
+    }
+    Stack.Truncate(env);
+    Current = caller;
+    return ret;
+  }
+
+  Value global(size_t index) {
+    if (Evaluated[index]) {
+      return Vals[index];
+    }
+    if (Evaluating[index]) {
+      fail("cyclic value definition");
+    }
+    Evaluating[index] = true;
+    auto caller = Current;
+    Current = {};
+    auto v = Eval(P.Defs[index].Ret, NoEnv, false);
+    Current = caller;
+    Evaluating[index] = false;
+    Evaluated[index] = true;
+    Vals[index] = v;
+    return v;
+  }
+
+  Value lookup(int id, size_t env) {
+    auto f = env == NoEnv ? nullptr : Stack[env].Ref();
+    for (; f; f = static_cast<Frame *>(f)->Up) {
+      auto frame = static_cast<Frame *>(f);
+      for (uint32_t i = 0; i < frame->Count; i++) {
+        if (frame->Vars()[i].ID == id) {
+          return frame->Vars()[i].Val;
+        }
+      }
+    }
+    if (auto index = P.Find(id);
+        index && P.Defs[*index].Kind == parsing::DefKind::Val) {
+      return global(*index);
+    }
+    return Value::Of(Heap.NewClosure(nullptr, id));
+  }
+
+  // Calls through the slot, so tasks that do not compile are interpreted.
+  static int64_t runTask(void *data, int64_t arg) {
+    auto slot = static_cast<jit::Slot *>(data);
+    return slot->Code.load(std::memory_order_acquire)(slot, &arg);
+  }
+
+  // Whether the function and everything it calls can run as native code,
+  // compiling what is not compiled yet.
+  bool compiled(size_t index) {
+    if (Detached[index]) {
+      return true;
+    }
+    if (Opts.JIT == jit::Mode::Off || !Slots[index].Eligible) {
+      return false;
+    }
+    std::vector<size_t> reached{index}, missing{};
+    std::vector<bool> seen(Slots.size());
+    seen[index] = true;
+    for (size_t i = 0; i < reached.size(); i++) {
+      const auto &slot = Slots[reached[i]];
+      auto state = slot.State.load(std::memory_order_relaxed);
+      if (state == jit::Tier::Failed) {
+        return false;
+      }
+      if (state != jit::Tier::Native) {
+        missing.push_back(reached[i]);
+      }
+      std::vector<size_t> callees{};
+      jit::Callees(P, slot.Def->Ret, callees);
+      for (auto callee : callees) {
+        if (!seen[callee]) {
+          seen[callee] = true;
+          reached.push_back(callee);
+        }
+      }
+    }
+    Detached[index] = missing.empty() || Compiler.Compile(missing, "spawn");
+    return Detached[index];
+  }
+
+  // Tasks run on the pool when the function compiles, otherwise on this
+  // thread while the script waits in await, send or recv.
+  Value spawn(size_t base) {
+    auto fn = Stack[base].Ref();
+    auto c = fn && fn->Kind == gc::ObjectKind::Closure
+                 ? static_cast<Closure *>(fn)
+                 : nullptr;
+    auto index = c && !c->Lam ? P.Find(c->ID) : std::nullopt;
+    if (!index || P.Defs[*index].Kind != parsing::DefKind::Fn ||
+        P.Defs[*index].Params.size() != 1) {
+      fail("task is not a function of one argument");
+    }
+    if (!gc::Heap::IsNumber(Stack[base + 1])) {
+      fail("task argument is not a number");
+    }
+    auto t = std::make_unique<task::Task>();
+    t->Code = runTask;
+    t->Data = &Slots[*index];
+    t->Arg = gc::Heap::Num(Stack[base + 1]);
+    if (compiled(*index)) {
+      Scheduler.Spawn(t.get());
+    } else {
+      Scheduler.Defer(t.get());
+    }
+    auto id = NextTask++;
+    Tasks.emplace(id, std::move(t));
+    return Heap.Number(id);
+  }
+
+  Value await(int64_t id) {
+    auto it = Tasks.find(id);
+    if (it == Tasks.end()) {
+      fail("await of an unknown task");
+    }
+    auto t = std::move(it->second);
+    Tasks.erase(it);
+    Scheduler.Await(*t);
+    return Heap.Number(t->Result);
+  }
+
+  // Extern declarations resolve their C function on the first call and keep
+  // a trampoline for its arity.
+  std::pair<void *, jit::Trampoline> external(const parsing::Expr &e) {
+    if (auto it = Externs.find(&e); it != Externs.end()) {
+      return it->second;
+    }
+    auto fn = dlsym(RTLD_DEFAULT, e.Text.c_str());
+    if (!fn) {
+      fail("extern function not found");
+    }
+    auto entry = std::make_pair(fn, jit::Trampolines[e.Subs.size()]);
+    Externs.emplace(&e, entry);
+    return entry;
+  }
+
+  gc::Array *array(size_t at) {
+    auto o = Stack[at].Ref();
+    if (!o || o->Kind != gc::ObjectKind::Array) {
+      fail("not an array");
+    }
+    return static_cast<gc::Array *>(o);
+  }
+
+  // The top-level function behind a function value, with the numbers it
+  // captured as its leading arguments. Lambdas have one once lifted.
+  std::optional<size_t> callee(Value f, std::vector<int64_t> &captures) {
+    auto o = f.Ref();
+    if (!o || o->Kind != gc::ObjectKind::Closure) {
+      return {};
+    }
+    auto c = static_cast<Closure *>(o);
+    auto index = P.Find(c->Lam ? c->Lam->ID : c->ID);
+    if (!index || P.Defs[*index].Kind != parsing::DefKind::Fn) {
+      return {};
+    }
+    if (auto env = static_cast<Frame *>(c->Env)) {
+      for (uint32_t i = 0; i < env->Count; i++) {
+        const auto &v = env->Vars()[i].Val;
+        if (!gc::Heap::IsNumber(v)) {
+          return {};
+        }
+        captures.push_back(gc::Heap::Num(v));
+      }
+    }
+    return index;
+  }
+
+  jit::Kernel kernel(jit::Pattern pattern, size_t index, size_t captures) {
+    auto key = std::make_pair(pattern, index);
+    if (auto it = Kernels.find(key); it != Kernels.end()) {
+      return it->second;
+    }
+    jit::Kernel k{};
+    auto arity = captures + (pattern == jit::Pattern::Reduce ? 2 : 1);
+    if (P.Defs[index].Params.size() == arity && compiled(index)) {
+      k = Compiler.CompileKernel(pattern, index, captures);
+    }
+    Kernels.emplace(key, k);
+    return k;
+  }
+
+  struct Chunk {
+    jit::Kernel Code{};
+    const int64_t *In{};
+    int64_t *Out{};
+    int64_t Len{}, Acc{};
+    const int64_t *Captures{};
+  };
+
+  static int64_t runChunk(void *data, int64_t) {
+    auto c = static_cast<Chunk *>(data);
+    return c->Code(c->In, c->Out, c->Len, c->Acc, c->Captures);
+  }
+
+  // Splits n elements into a few chunks per thread, none smaller than
+  // MinChunk unless there is only one.
+  std::vector<Chunk> split(int64_t n) {
+    static constexpr int64_t MinChunk = 4096;
+    auto most = static_cast<int64_t>(Opts.Workers + 1) * 4;
+    auto count = std::clamp<int64_t>(n / MinChunk, 1, most);
+    std::vector<Chunk> chunks(static_cast<size_t>(count));
+    int64_t start = 0;
+    for (int64_t i = 0; i < count; i++) {
+      auto &c = chunks[static_cast<size_t>(i)];
+      c.Len = n / count + (i < n % count);
+      c.Acc = start;
+      start += c.Len;
+    }
+    return chunks;
+  }
+
+  // Runs every chunk but the last on the pool and the last one here. The
+  // awaits are outside of any safe point, so no interpreted task runs here in
+  // the meantime and nothing allocates while the workers use the arrays.
+  std::vector<int64_t> run(std::vector<Chunk> &chunks) {
+    std::vector<task::Task> tasks(chunks.size() - 1);
+    for (size_t i = 0; i < tasks.size(); i++) {
+      tasks[i].Code = runChunk;
+      tasks[i].Data = &chunks[i];
+      Scheduler.Spawn(&tasks[i]);
+    }
+    std::vector<int64_t> results(chunks.size());
+    // Every chunk uses the arrays, so all of them finish before a fault is
+    // raised again.
+    std::exception_ptr failed{};
+    try {
+      results.back() = runChunk(&chunks.back(), 0);
+    } catch (...) {
+      failed = std::current_exception();
+    }
+    for (size_t i = 0; i < tasks.size(); i++) {
+      try {
+        Scheduler.Await(tasks[i]);
+        results[i] = tasks[i].Result;
+      } catch (...) {
+        failed = failed ? failed : std::current_exception();
+      }
+    }
+    if (failed) {
+      std::rethrow_exception(failed);
+    }
+    return results;
+  }
+
+  // The function runs natively over chunks of the array on the pool when it
+  // compiles, otherwise the interpreter applies it element by element. A
+  // reduction folds each chunk from its first element and then folds the
+  // results of the chunks into the initial value in order, so its function
+  // must be associative to give the same result as the interpreter.
+  Value parallel(jit::Pattern pattern, size_t base) {
+    auto src = pattern == jit::Pattern::Reduce ? base + 2 : base + 1;
+    auto n = array(src)->Len;
+    std::vector<int64_t> captures{};
+    jit::Kernel k{};
+    if (auto index = callee(Stack[base], captures)) {
+      k = kernel(pattern, *index, captures.size());
+    }
+    if (!k) {
+      return sequential(pattern, base);
+    }
+
+    auto chunks = split(n);
+    // The result of a map stays on the stack until it is returned.
+    auto top = Stack.Size();
+    gc::Array *out{};
+    std::vector<int64_t> kept{};
+    switch (pattern) {
+    case jit::Pattern::Map:
+      out = Heap.NewArray(n);
+      Stack.Push(Value::Of(out));
+      break;
+    case jit::Pattern::Reduce:
+      if (n == 0) {
+        return Stack[base + 1];
+      }
+      break;
+    case jit::Pattern::Filter:
+      kept.resize(static_cast<size_t>(n));
+      break;
+    }
+    // Allocating the result may have moved the input, so it is looked up
+    // again. Nothing allocates while the chunks run, so both stay put.
+    auto in = array(src)->Items();
+    for (auto &c : chunks) {
+      auto start = c.Acc;
+      c.Code = k;
+      c.In = in + start;
+      c.Out = out ? out->Items() + start : kept.data() + start;
+      c.Captures = captures.data();
+      // Reductions start from the first element of their chunk.
+      if (pattern == jit::Pattern::Reduce) {
+        c.Acc = *c.In++;
+        c.Len--;
+        c.Out = nullptr;
+      }
+    }
+    auto results = run(chunks);
+
+    switch (pattern) {
+    case jit::Pattern::Map:
+      Stack.Truncate(top);
+      return Value::Of(out);
+    case jit::Pattern::Reduce: {
+      auto acc = gc::Heap::Num(Stack[base + 1]);
+      for (auto r : results) {
+        acc = k(&r, nullptr, 1, acc, captures.data());
+      }
+      return Heap.Number(acc);
+    }
+    case jit::Pattern::Filter: {
+      int64_t total = 0;
+      for (auto r : results) {
+        total += r;
+      }
+      out = Heap.NewArray(total);
+      auto dst = out->Items();
+      for (size_t i = 0; i < chunks.size(); i++) {
+        auto bytes = static_cast<size_t>(results[i]) * sizeof(int64_t);
+        memcpy(dst, chunks[i].Out, bytes);
+        dst += results[i];
+      }
+      return Value::Of(out);
+    }
+    }
+    unreachable();
+  }
+
+  Value sequential(jit::Pattern pattern, size_t base) {
+    auto reduce = pattern == jit::Pattern::Reduce;
+    auto src = reduce ? base + 2 : base + 1;
+    auto n = array(src)->Len;
+    auto acc = reduce ? gc::Heap::Num(Stack[base + 1]) : 0;
+    std::vector<int64_t> kept{};
+    auto out = Stack.Size();
+    if (pattern == jit::Pattern::Map) {
+      auto a = Heap.NewArray(n);
+      Stack.Push(Value::Of(a));
+    }
+    for (int64_t i = 0; i < n; i++) {
+      auto args = Stack.Size();
+      auto x = array(src)->Items()[i];
+      if (reduce) {
+        Stack.Push(Heap.Number(acc));
+      }
+      auto v = Heap.Number(x);
+      Stack.Push(v);
+      auto y = Apply(base, args, Stack.Size() - args);
+      Stack.Truncate(args);
+      if (!gc::Heap::IsNumber(y)) {
+        fail("array element is not a number");
+      }
+      switch (pattern) {
+      case jit::Pattern::Map:
+        array(out)->Items()[i] = gc::Heap::Num(y);
+        break;
+      case jit::Pattern::Reduce:
+        acc = gc::Heap::Num(y);
+        break;
+      case jit::Pattern::Filter:
+        if (gc::Heap::Num(y) != 0) {
+          kept.push_back(x);
+        }
+        break;
+      }
+    }
+    switch (pattern) {
+    case jit::Pattern::Map: {
+      auto ret = Stack[out];
+      Stack.Truncate(out);
+      return ret;
+    }
+    case jit::Pattern::Reduce:
+      return Heap.Number(acc);
+    case jit::Pattern::Filter: {
+      auto a = Heap.NewArray(static_cast<int64_t>(kept.size()));
+      std::copy(kept.begin(), kept.end(), a->Items());
+      return Value::Of(a);
+    }
+    }
+    unreachable();
+  }
+
+  // Arithmetic wraps like native code, so it is done on unsigned words.
+  Value primitive(Builtin op, size_t base, size_t n) {
+    if (Builtins[static_cast<size_t>(op)].Arity != n) {
+      fail("arity mismatch");
+    }
+    auto x = gc::Heap::Num(Stack[base]);
+    auto y = n > 1 ? gc::Heap::Num(Stack[base + 1]) : 0;
+    auto ux = static_cast<uint64_t>(x), uy = static_cast<uint64_t>(y);
+    switch (op) {
+    case Builtin::Add:
+      return Heap.Number(static_cast<int64_t>(ux + uy));
+    case Builtin::Sub:
+      return Heap.Number(static_cast<int64_t>(ux - uy));
+    case Builtin::Mul:
+      return Heap.Number(static_cast<int64_t>(ux * uy));
+    case Builtin::Div:
+    case Builtin::Rem:
+      if (y == 0) {
+        fail("division by zero");
+      }
+      // The minimum divided by -1 overflows, and wraps to itself.
+      if (y == -1) {
+        return Heap.Number(op == Builtin::Div ? static_cast<int64_t>(0 - ux)
+                                              : 0);
+      }
+      return Heap.Number(op == Builtin::Div ? x / y : x % y);
+    case Builtin::Eq:
+      return Value::Immediate(x == y);
+    case Builtin::Lt:
+      return Value::Immediate(x < y);
+    case Builtin::Le:
+      return Value::Immediate(x <= y);
+    case Builtin::Not:
+      return Value::Immediate(x == 0);
+    case Builtin::Print:
+      return Heap.Number(jit::print(x));
+    case Builtin::Wait:
+      return Heap.Number(launcher().Wait(static_cast<uint64_t>(x)));
+    case Builtin::Spawn:
+      return spawn(base);
+    case Builtin::Await: {
+      task::Pool::SafePoint safe{Scheduler};
+      return await(x);
+    }
+    case Builtin::Chan:
+      return Heap.Number(task::Open(x));
+    case Builtin::Send: {
+      task::Pool::SafePoint safe{Scheduler};
+      return Heap.Number(task::Send(x, y));
+    }
+    case Builtin::Recv: {
+      task::Pool::SafePoint safe{Scheduler};
+      return Heap.Number(task::Recv(x));
+    }
+    case Builtin::Array:
+      return Value::Of(Heap.NewArray(x));
+    case Builtin::Len:
+      return Heap.Number(array(base)->Len);
+    case Builtin::Get:
+    case Builtin::Set: {
+      auto a = array(base);
+      if (y < 0 || y >= a->Len) {
+        fail("array index out of bounds");
+      }
+      if (op == Builtin::Get) {
+        return Heap.Number(a->Items()[y]);
+      }
+      if (!gc::Heap::IsNumber(Stack[base + 2])) {
+        fail("array element is not a number");
+      }
+      a->Items()[y] = gc::Heap::Num(Stack[base + 2]);
+      return Value::Immediate(0);
+    }
+    case Builtin::ParMap:
+      return parallel(jit::Pattern::Map, base);
+    case Builtin::ParReduce:
+      return parallel(jit::Pattern::Reduce, base);
+    case Builtin::ParFilter:
+      return parallel(jit::Pattern::Filter, base);
+    }
+    unreachable();
+  }
+
+public:
+  Interpreter(const parsing::Program &p, jit::Options opts,
+              const gc::Options &heap, const shell::Options &shell)
+      : P{p}, Opts{opts}, Slots(p.Defs.size()), Heap{heap},
+        Vals(p.Defs.size()), Evaluated(p.Defs.size()),
+        Evaluating(p.Defs.size()), Compiler{p, Slots.data(), Opts},
+        ShellOpts{shell}, Detached(p.Defs.size()), Scheduler{opts.Workers, Chans} {
+    Heap.Root(&Stack);
+    Heap.Root(&Vals);
+    auto eligible = jit::Eligible(p);
+    for (size_t i = 0; i < Slots.size(); i++) {
+      auto &slot = Slots[i];
+      slot.Code.store(Opts.JIT == jit::Mode::Lazy && eligible[i] ? lazy
+                                                                 : interpreted,
+                      std::memory_order_relaxed);
+      slot.Def = &p.Defs[i];
+      slot.Owner = this;
+      slot.Eligible = eligible[i];
+    }
+    // Functions the profile says are hot are compiled right away instead of
+    // waiting for the counters to warm up again.
+    if (Opts.JIT != jit::Mode::Tiered || !Opts.Profile || Opts.Instrument) {
+      return;
+    }
+    for (size_t i = 0; i < Slots.size(); i++) {
+      auto &slot = Slots[i];
+      auto profiled = Opts.Profile->Find(*slot.Def);
+      if (slot.Eligible && profiled &&
+          (profiled->Count >= Opts.CallThreshold ||
+           profiled->Taken >= Opts.LoopThreshold)) {
+        slot.State.store(jit::Tier::Queued, std::memory_order_relaxed);
+        Compiler.Enqueue(i);
+      }
+    }
+  }
+
+  // Arguments are the n values from base on the stack, which the caller pops.
+  Value Call(size_t index, size_t base, size_t n) {
+    auto &slot = Slots[index];
+    if (slot.Def->Kind != parsing::DefKind::Fn) {
+      Stack.Push(global(index));
+      auto ret = Apply(Stack.Size() - 1, base, n);
+      Stack.Pop();
+      return ret;
+    }
+    // Calls go through the slot unless it still points at the interpreter.
+    if (slot.Code.load(std::memory_order_relaxed) != interpreted &&
+        numeric(base, n)) {
+      return native(slot, base, n);
+    }
+    return invoke(index, base, n);
+  }
+
+  // Applies the function value at index f of the stack.
+  Value Apply(size_t f, size_t base, size_t n) {
+    auto fn = Stack[f].Ref();
+    if (!fn || fn->Kind != gc::ObjectKind::Closure) {
+      fail("not a function");
+    }
+    auto c = static_cast<Closure *>(fn);
+    if (auto lam = c->Lam) {
+      auto caller = Current;
+      Current = {};
+      auto frame = bind(lam->Params, base, n);
+      Heap.Write(frame, frame->Up, static_cast<Closure *>(Stack[f].Ref())->Env);
+      auto env = Stack.Size();
+      Stack.Push(Value::Of(frame));
+      auto ret = Eval(lam->Subs[0], env, false);
+      Stack.Pop();
+      Current = caller;
+      return ret;
+    }
+    if (auto op = AsBuiltin(c->ID)) {
+      return primitive(*op, base, n);
+    }
+    return Call(*P.Find(c->ID), base, n);
+  }
+
+  // Evaluates under the frame at index env of the stack, leaving the stack as
+  // it was, except for the arguments of a self tail call.
+  Value Eval(const parsing::Expr &e, size_t env, bool tail) {
+    using parsing::ExprKind;
+    switch (e.Kind) {
+    case ExprKind::Num:
+      return Heap.Number(e.Num);
+    case ExprKind::Unit:
+    case ExprKind::False:
+      return Value::Immediate(0);
+    case ExprKind::True:
+      return Value::Immediate(1);
+    case ExprKind::Resolved:
+      return lookup(e.ID, env);
+    case ExprKind::Ite: {
+      auto cond = Eval(e.Subs[0], env, false);
+      auto taken = cond.Truthy();
+      if (auto counter = site(e)) {
+        counter->Count.fetch_add(1, std::memory_order_relaxed);
+        counter->Taken.fetch_add(taken, std::memory_order_relaxed);
+      }
+      return Eval(taken ? e.Subs[1] : e.Subs[2], env, tail);
+    }
+    case ExprKind::Lam: {
+      if (e.Captures.empty()) {
+        return Value::Of(Heap.NewClosure(&e, 0));
+      }
+      auto base = Stack.Size();
+      for (auto id : e.Captures) {
+        auto v = lookup(id, env);
+        Stack.Push(v);
+      }
+      auto frame = Heap.NewFrame(static_cast<uint32_t>(e.Captures.size()));
+      for (size_t i = 0; i < e.Captures.size(); i++) {
+        auto &var = frame->Vars()[i];
+        var.ID = e.Captures[i];
+        Heap.Write(frame, var.Val, Stack[base + i]);
+      }
+      Stack.Truncate(base);
+      Stack.Push(Value::Of(frame));
+      auto c = Heap.NewClosure(&e, 0);
+      Heap.Write(c, c->Env, Stack[base].Ref());
+      Stack.Truncate(base);
+      return Value::Of(c);
+    }
+    case ExprKind::App: {
+      auto base = Stack.Size();
+      auto n = e.Subs.size() - 1;
+      for (size_t i = 1; i < e.Subs.size(); i++) {
+        auto v = Eval(e.Subs[i], env, false);
+        Stack.Push(v);
+      }
+      if (auto counter = site(e)) {
+        counter->Count.fetch_add(1, std::memory_order_relaxed);
+      }
+      const auto &f = e.Subs[0];
+      Value ret{};
+      if (f.Kind == ExprKind::Resolved) {
+        if (auto op = AsBuiltin(f.ID)) {
+          ret = primitive(*op, base, n);
+          Stack.Truncate(base);
+          return ret;
+        }
+        auto index = P.Find(f.ID);
+        if (index && tail && index == Current &&
+            P.Defs[*index].Params.size() == n) {
+          Looping = true;
+          return {};
+        }
+        if (index) {
+          ret = Call(*index, base, n);
+          Stack.Truncate(base);
+          return ret;
+        }
+      }
+      auto fn = Eval(f, env, false);
+      Stack.Push(fn);
+      ret = Apply(base + n, base, n);
+      Stack.Truncate(base);
+      return ret;
+    }
+    case ExprKind::Cmd: {
+      std::vector<int64_t> numbers{};
+      for (const auto &sub : e.Subs) {
+        auto v = Eval(sub, env, false);
+        if (!gc::Heap::IsNumber(v)) {
+          fail("command argument is not a number");
+        }
+        numbers.push_back(gc::Heap::Num(v));
+      }
+      if (auto counter = site(e)) {
+        counter->Count.fetch_add(1, std::memory_order_relaxed);
+      }
+      return Heap.Number(launcher().Run(e, numbers.data()));
+    }
+    case ExprKind::Extern: {
+      int64_t args[parsing::MaxExternParams]{};
+      for (size_t i = 0; i < e.Subs.size(); i++) {
+        auto v = Eval(e.Subs[i], env, false);
+        if (!gc::Heap::IsNumber(v)) {
+          fail("extern argument is not a number");
+        }
+        args[i] = jit::Narrow(e.Signature[i], gc::Heap::Num(v));
+      }
+      auto [fn, call] = external(e);
+      auto ret = e.Signature.back();
+      auto n = call(fn, args);
+      // Only the low byte of a C bool result is defined.
+      if (ret == parsing::CType::Bool) {
+        n = jit::Narrow(parsing::CType::UChar, n);
+      }
+      return Heap.Number(jit::Narrow(ret, n));
+    }
+    case ExprKind::Unresolved:
+      break;
+    }
+    unreachable();
+  }
+
+  // Runs the functions the image has natively from now on. The image calls
+  // nothing through the slots of this interpreter, so it is shared as is.
+  void Share(std::shared_ptr<gcc_jit_result> image) {
+    for (auto &slot : Slots) {
+      auto code = gcc_jit_result_get_code(
+          image.get(), jit::Codegen::EntryName(*slot.Def).c_str());
+      if (slot.Def->Kind == parsing::DefKind::Fn && code) {
+        slot.Code.store(reinterpret_cast<jit::Entry>(code),
+                        std::memory_order_release);
+        slot.State.store(jit::Tier::Native, std::memory_order_relaxed);
+      }
+    }
+    Image = std::move(image);
+  }
+
+  // Calls a function with numbers, for hosts running the interpreter.
+  // Forgets the evaluation an exception left, so the interpreter can be
+  // entered again.
+  void unwound(size_t base) {
+    Stack.Truncate(base);
+    Current = {};
+    Looping = false;
+    std::fill(Evaluating.begin(), Evaluating.end(), false);
+  }
+
+  Result<int64_t> Invoke(size_t index, const int64_t *args, size_t n) {
+    task::Pool::Scope scope{Scheduler};
+    const auto &d = P.Defs[index];
+    if (d.Kind != parsing::DefKind::Fn || d.Params.size() != n) {
+      return Error{"arity mismatch"};
+    }
+    auto base = Stack.Size();
+    Value ret{};
+    try {
+      for (size_t i = 0; i < n; i++) {
+        Stack.Push(Heap.Number(args[i]));
+      }
+      ret = Call(index, base, n);
+    } catch (const gc::OutOfMemory &) {
+      unwound(base);
+      return Error{"out of memory"};
+    } catch (...) {
+      // A fault the host's handler turned into an exception.
+      unwound(base);
+      throw;
+    }
+    Stack.Truncate(base);
+    if (!gc::Heap::IsNumber(ret)) {
+      return Error{"result is not a number"};
+    }
+    return gc::Heap::Num(ret);
+  }
+
+  Result<Value> Run() {
+    task::Pool::Scope scope{Scheduler};
+    for (size_t i = 0; i < P.Defs.size(); i++) {
+      const auto &d = P.Defs[i];
+      if (d.Text == "main") {
+        if (d.Kind != parsing::DefKind::Fn || !d.Params.empty()) {
+          return Error{"main must be a function without parameters"};
+        }
+        try {
+          return Call(i, Stack.Size(), 0);
+        } catch (const gc::OutOfMemory &) {
+          return Error{"out of memory"};
+        }
+      }
+    }
+    return Error{"main function not found"};
+  }
+
+  const gc::Heap &Memory() const { return Heap; }
+};
+
+} // namespace eval
+
+class Driver {
+  const char *Filename;
+  FILE *Infile;
+  parsing::IDs IDs{};
+  std::string Reason{};
+
+public:
+  explicit Driver(const char *file) : Filename{file} {
+    Infile = fopen(Filename, "r");
+    if (!Infile) {
+      Reason = std::string{Filename} + ": " + strerror(errno);
+    }
+  }
+
+  ~Driver() {
+    if (!Infile) {
+      return;
+    }
+    int ret = fclose(Infile);
+    if (ret != 0) {
+      perror("close file error");
+      panic("close driver error");
+    }
+  }
+
+  static void PrintVersion() {
+    std::cout << "JianScript v" << JIAN_VERSION_MAJOR << '.'
+              << JIAN_VERSION_MINOR << '.' << JIAN_VERSION_PATCH << std::endl;
+  }
+
+  static void PrintUsage() {
+    std::cout << "JianScript programming language.\n"
+                 "\n"
+                 "Usage:\n"
+                 "\n"
+                 "\tjian <command> [<arguments>]\n"
+                 "\n"
+                 "Commands are:\n"
+                 "\n"
+                 "\tjian run\t\trun a script with the default JIT mode\n"
+                 "\tjian build\tcompile a script ahead of time\n"
+                 "\tjian help\tprint this usage message\n"
+                 "\tjian version\tprint the version\n"
+                 "\n"
+                 "Common options are:\n"
+                 "\n"
+                 "\t-O<n>\t\t\toptimization level, simplify from 1 (default "
+                 "2)\n"
+                 "\t-march=native\t\tgenerate code for the host CPU\n"
+                 "\t-g\t\t\temit debug info for native code\n"
+                 "\t--dump=<dir>\t\tdump every compiled context to dir\n"
+                 "\t-l<name>\t\tload extern functions from the C library "
+                 "lib<name>\n"
+                 "\t--opt-report\t\tprint what the optimizer did to stderr\n"
+                 "\t--profile-use=<file>\toptimize with a recorded profile\n"
+                 "\n"
+                 "Common options are also read from JIAN_OPTIONS, and @O<n> "
+                 "before a function\n"
+                 "overrides its optimization level.\n"
+                 "\n"
+                 "Run options are:\n"
+                 "\n"
+                 "\t--no-jit\t\tonly use the interpreter\n"
+                 "\t--lazy-jit\t\tcompile every function on its first call\n"
+                 "\t--tier-calls=<n>\tcompile a function after n calls\n"
+                 "\t--tier-loops=<n>\tcompile a function after n loop "
+                 "iterations\n"
+                 "\t--tier-trace\t\tprint tier-up events to stderr\n"
+                 "\t--gc-nursery=<n>\tallocate new objects in n KiB (default "
+                 "1024)\n"
+                 "\t--gc-max-pause-us=<n>\tbound collector pauses, 0 for none "
+                 "(default 1000)\n"
+                 "\t--gc-threads=<n>\tmark the heap with n threads\n"
+                 "\t--gc-limit=<n>\t\tfail when the heap needs more than n "
+                 "MiB\n"
+                 "\t--gc-stats\t\tprint heap statistics to stderr\n"
+                 "\t--external-commands\tnever use the builtin commands\n"
+                 "\t--task-threads=<n>\trun spawned tasks on n threads, 0 to "
+                 "run them\n"
+                 "\t\t\t\twhen awaited\n"
+                 "\t--no-simd\t\tcompile array kernels without vector types\n"
+                 "\t--profile-generate=<file>\n"
+                 "\t\t\t\trecord a profile of the run\n"
+                 "\n"
+                 "Build options are:\n"
+                 "\n"
+                 "\t-j <n>\t\t\tcompile with n worker processes\n"
+                 "\t-o <file>\t\twrite the output to file\n"
+                 "\t--shared\t\tbuild a shared library\n"
+                 "\t-v\t\t\tprint build progress to stderr\n"
+                 "\n";
+  }
+
+  // Why the script could not be opened or loaded, for the caller to report.
+  [[nodiscard]] const std::string &Diagnostic() const { return Reason; }
+
+  // Libraries keep every definition written in the script, otherwise only
+  // what main reaches is kept.
+  bool Load(parsing::Program &p, const opt::Options &opts,
+            bool library = false) {
+    if (!Infile) {
+      return false;
+    }
+    parsing::Source src{Infile, IDs};
+    if (!parsing::Parser{src, IDs}.ParseProgram(p)) {
+      auto loc = src.Here();
+      Reason = std::string{Filename} + ":" + std::to_string(loc.Ln) + ":" +
+               std::to_string(loc.Col) + ": Parse error (pos=" +
+               std::to_string(loc.Pos) + ")";
+      return false;
+    }
+
+    parsing::Resolver resolver{};
+    if (!resolver.ResolveProgram(p)) {
+      Reason = std::string{Filename} + ":" +
+               std::to_string(resolver.NameSpan.Start.Ln) + ":" +
+               std::to_string(resolver.NameSpan.Start.Col) +
+               ": resolve error: " +
+               parsing::Resolution_ToString(resolver.State) + " \"" +
+               resolver.NameText + "\"";
+      return false;
+    }
+
+    if (opts.Level >= 1) {
+      auto before = opt::Size(p);
+      opt::Simplifier simplifier{p, IDs, opts};
+      simplifier.Simplify();
+      if (opts.Report) {
+        auto after = opt::Size(p);
+        fprintf(stderr,
+                "simplify: %zu -> %zu nodes, removed %zu (%zu folded, %zu "
+                "branches, %zu values inlined, %zu lambdas reduced)\n",
+                before, after, before > after ? before - after : 0,
+                simplifier.Folded, simplifier.Branches, simplifier.Inlined,
+                simplifier.Reduced);
+      }
+    }
+    auto written = p.Defs.size();
+    opt::Closures{p, IDs}.Convert();
+
+    std::vector<size_t> roots{};
+    for (size_t i = 0; i < p.Defs.size(); i++) {
+      if (library ? i < written : p.Defs[i].Text == "main") {
+        roots.push_back(i);
+      }
+    }
+    if (opts.Level >= 1 && !roots.empty()) {
+      auto pruned = opt::Prune(p, roots);
+      if (opts.Report && !pruned.empty()) {
+        std::string names{};
+        for (const auto &name : pruned) {
+          names += names.empty() ? name : ", " + name;
+        }
+        fprintf(stderr, "prune: dropped %zu definitions (%s)\n", pruned.size(),
+                names.c_str());
+      }
+    }
+    return true;
+  }
+
+  // Sites are keyed by definitions and spans, so a profile only applies to the
+  // script and options it was generated with.
+  bool Profile(const parsing::Program &p, const opt::Options &opts,
+               pgo::Profile &profile) {
+    profile.Prepare(p);
+    if (opts.ProfileUse && !profile.Load(opts.ProfileUse)) {
+      printf("%s: cannot read profile %s\n", Filename, opts.ProfileUse);
+      return false;
+    }
+    return true;
+  }
+
+  static jit::Target Target(const opt::Options &opts) {
+    return {static_cast<int>(std::min(opts.Level, 3U)), opts.Native,
+            opts.Debug, opts.Dump ? opts.Dump : ""};
+  }
+
+  int Build(const opt::Options &o, aot::Options opts) {
+    parsing::Program p{};
+    if (!Load(p, o, opts.Shared)) {
+      printf("%s\n", Reason.c_str());
+      return -1;
+    }
+    opts.Code = Target(o);
+    opts.Libraries = o.Libraries;
+    if (o.ProfileGenerate) {
+      printf("%s: profiles are generated by run\n", Filename);
+      return -1;
+    }
+    pgo::Profile profile{};
+    if (o.ProfileUse) {
+      if (!Profile(p, o, profile)) {
+        return -1;
+      }
+      opts.Profile = &profile;
+    }
+    if (opts.Output.empty()) {
+      std::string stem{Filename};
+      if (auto slash = stem.rfind('/'); slash != std::string::npos) {
+        stem = stem.substr(slash + 1);
+      }
+      if (auto dot = stem.rfind('.'); dot != std::string::npos && dot > 0) {
+        stem = stem.substr(0, dot);
+      }
+      opts.Output = opts.Shared ? "lib" + stem + ".so" : stem;
+      if (opts.Output == Filename) {
+        opts.Output += ".out";
+      }
+    }
+    auto ret = aot::Builder{p, opts}.Build();
+    if (auto err = std::get_if<Error>(&ret)) {
+      printf("%s: %s\n", Filename, err->What());
+      return -1;
+    }
+    return 0;
+  }
+
+  int Run(const opt::Options &o, jit::Options opts, const gc::Options &heap,
+          const shell::Options &shell) {
+    parsing::Program p{};
+    if (!Load(p, o)) {
+      printf("%s\n", Reason.c_str());
+      return -1;
+    }
+    opts.Code = Target(o);
+    // Loaded globally, so native code finds extern functions in them too.
+    for (auto lib : o.Libraries) {
+      auto name = std::string{"lib"} + lib + ".so";
+      if (!dlopen(name.c_str(), RTLD_NOW | RTLD_GLOBAL)) {
+        printf("%s: %s\n", Filename, dlerror());
+        return -1;
+      }
+    }
+    pgo::Profile profile{};
+    if (o.ProfileGenerate || o.ProfileUse) {
+      if (!Profile(p, o, profile)) {
+        return -1;
+      }
+      opts.Profile = &profile;
+      opts.Instrument = o.ProfileGenerate;
+    }
+
+    eval::Interpreter interp{p, opts, heap, shell};
+    auto ret = interp.Run();
+    fflush(stdout);
+    if (heap.Stats) {
+      interp.Memory().Report();
+    }
+    if (auto err = std::get_if<Error>(&ret)) {
+      printf("%s: %s\n", Filename, err->What());
+      return -1;
+    }
+    if (o.ProfileGenerate && !profile.Save(o.ProfileGenerate)) {
+      printf("%s: cannot write profile %s\n", Filename, o.ProfileGenerate);
+      return -1;
+    }
+    return 0;
+  }
+};
+
+static inline std::optional<uint32_t> parseCount(const char *arg,
+                                                 const char *prefix) {
+  auto n = strlen(prefix);
+  if (strncmp(arg, prefix, n) != 0) {
+    return {};
+  }
+  char *end = nullptr;
+  errno = 0;
+  auto v = strtoul(arg + n, &end, 10);
+  if (end == arg + n || *end != '\0' || errno == ERANGE || v > UINT32_MAX) {
+    return {};
+  }
+  return static_cast<uint32_t>(v);
+}
+
+static inline bool parseOptOption(const char *arg, opt::Options &opts) {
+  if (auto n = parseCount(arg, "-O")) {
+    opts.Level = *n;
+    return true;
+  }
+  if (strcmp(arg, "--opt-report") == 0) {
+    opts.Report = true;
+    return true;
+  }
+  if (strcmp(arg, "-march=native") == 0) {
+    opts.Native = true;
+    return true;
+  }
+  if (strcmp(arg, "-g") == 0) {
+    opts.Debug = true;
+    return true;
+  }
+  if (strncmp(arg, "-l", 2) == 0 && arg[2] != '\0') {
+    opts.Libraries.push_back(arg + 2);
+    return true;
+  }
+  if (strncmp(arg, "--dump=", 7) == 0 && arg[7] != '\0') {
+    opts.Dump = arg + 7;
+    return true;
+  }
+  if (strncmp(arg, "--profile-generate=", 19) == 0 && arg[19] != '\0') {
+    opts.ProfileGenerate = arg + 19;
+    return true;
+  }
+  if (strncmp(arg, "--profile-use=", 14) == 0 && arg[14] != '\0') {
+    opts.ProfileUse = arg + 14;
+    return true;
+  }
+  return false;
+}
+
+// Common options from JIAN_OPTIONS come first, so the command line overrides
+// them. The parsed options point into a buffer that lives until exit.
+static inline bool parseEnvOptions(opt::Options &opts) {
+  static std::string buf{};
+  auto env = getenv("JIAN_OPTIONS");
+  if (!env) {
+    return true;
+  }
+  buf = env;
+  std::replace_if(
+      buf.begin(), buf.end(), [](char c) { return c == ' ' || c == '\t'; },
+      '\0');
+  for (size_t i = 0; i < buf.size(); i += strlen(buf.c_str() + i) + 1) {
+    if (buf[i] != '\0' && !parseOptOption(buf.c_str() + i, opts)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static inline int main(int argc, const char *argv[]) {
+  recovery();
+
+  if (argc == 2 && strcmp(argv[1], "help") == 0) {
+    Driver::PrintUsage();
+    return 0;
+  }
+  if (argc == 2 && strcmp(argv[1], "version") == 0) {
+    Driver::PrintVersion();
+    return 0;
+  }
+  opt::Options o{};
+  if (!parseEnvOptions(o)) {
+    fprintf(stderr, "invalid JIAN_OPTIONS\n");
+    return 1;
+  }
+  if (argc >= 3 && strcmp(argv[1], "build") == 0) {
+    aot::Options opts{};
+    opts.Jobs = std::max(std::thread::hardware_concurrency(), 1U);
+    for (int i = 2; i < argc - 1; i++) {
+      const char *arg = argv[i];
+      if (strcmp(arg, "-j") == 0 && i + 1 < argc - 1) {
+        auto n = parseCount(argv[++i], "");
+        if (!n || *n == 0) {
+          Driver::PrintUsage();
+          return 1;
+        }
+        opts.Jobs = *n;
+      } else if (strcmp(arg, "-o") == 0 && i + 1 < argc - 1) {
+        opts.Output = argv[++i];
+      } else if (strcmp(arg, "--shared") == 0) {
+        opts.Shared = true;
+      } else if (strcmp(arg, "-v") == 0) {
+        opts.Verbose = true;
+      } else if (!parseOptOption(arg, o)) {
+        Driver::PrintUsage();
+        return 1;
+      }
+    }
+    Driver driver{argv[argc - 1]};
+    return driver.Build(o, opts) == 0 ? 0 : 1;
+  }
+  if (argc < 3 || strcmp(argv[1], "run") != 0) {
+    Driver::PrintUsage();
+    return 1;
+  }
+
+  jit::Options opts{};
+  gc::Options heap{};
+  shell::Options shell{};
+  for (int i = 2; i < argc - 1; i++) {
+    const char *arg = argv[i];
+    if (strcmp(arg, "--no-jit") == 0) {
+      opts.JIT = jit::Mode::Off;
+    } else if (strcmp(arg, "--lazy-jit") == 0) {
+      opts.JIT = jit::Mode::Lazy;
+    } else if (strcmp(arg, "--tier-trace") == 0) {
+      opts.Trace = true;
+    } else if (auto n = parseCount(arg, "--tier-calls=")) {
+      opts.CallThreshold = *n;
+    } else if (auto m = parseCount(arg, "--tier-loops=")) {
+      opts.LoopThreshold = *m;
+    } else if (strcmp(arg, "--gc-stats") == 0) {
+      heap.Stats = true;
+    } else if (auto us = parseCount(arg, "--gc-max-pause-us=")) {
+      heap.MaxPause = std::chrono::microseconds{*us};
+    } else if (auto t = parseCount(arg, "--gc-threads="); t && *t > 0) {
+      heap.Markers = *t;
+    } else if (auto k = parseCount(arg, "--gc-nursery="); k && *k > 0) {
+      heap.Nursery = size_t{*k} * 1024;
+    } else if (auto mb = parseCount(arg, "--gc-limit=")) {
+      heap.MaxBytes = size_t{*mb} * 1024 * 1024;
+    } else if (strcmp(arg, "--external-commands") == 0) {
+      shell.External = true;
+    } else if (auto w = parseCount(arg, "--task-threads=")) {
+      opts.Workers = *w;
+    } else if (strcmp(arg, "--no-simd") == 0) {
+      opts.Vectorize = false;
+    } else if (!parseOptOption(arg, o)) {
+      Driver::PrintUsage();
+      return 1;
+    }
+  }
+
+  Driver driver{argv[argc - 1]};
+  return driver.Run(o, opts, heap, shell) == 0 ? 0 : 1;
 }
 
 } // namespace jian